@@ -0,0 +1,54 @@
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+#include "web_video_server/frame_buffer.h"
+#include <stdint.h>
+#include <vector>
+
+namespace web_video_server
+{
+
+/**
+ * @class BufferPool
+ * @brief Recycles byte buffers that are handed out as refcounted resources, so their memory is reused once every
+ *        connection is done writing them
+ */
+class BufferPool : public boost::enable_shared_from_this<BufferPool>
+{
+public:
+  typedef boost::shared_ptr<std::vector<uint8_t> > BufferPtr;
+
+  BufferPool(std::size_t max_free_buffers = 8);
+  ~BufferPool();
+
+  /**
+   * @brief  Returns an empty buffer, which goes back to the pool when the last reference to it is released. Fill it
+   *         before sharing it as a FrameBufferPtr.
+   */
+  BufferPtr acquire();
+
+private:
+  class Recycler
+  {
+  public:
+    Recycler(boost::weak_ptr<BufferPool> pool);
+    void operator()(std::vector<uint8_t> *buffer);
+
+  private:
+    boost::weak_ptr<BufferPool> pool_;
+  };
+
+  void release(std::vector<uint8_t> *buffer);
+
+  const std::size_t max_free_buffers_;
+  boost::mutex mutex_;
+  std::vector<std::vector<uint8_t>*> free_buffers_;
+};
+
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef ENCODER_POOL_H_
+#define ENCODER_POOL_H_
+
+#include <boost/atomic.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/weak_ptr.hpp>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace web_video_server
+{
+
+/**
+ * @class EncoderPool
+ * @brief Threads converting and encoding images, so that slow encodes never hold up the ROS callback threads.
+ *        Every thread has a deque of ready queues per priority, idle threads steal from the others, and the highest
+ *        priority with ready queues anywhere is always served first.
+ */
+class EncoderPool : public boost::enable_shared_from_this<EncoderPool>
+{
+public:
+  typedef boost::function<void()> Job;
+
+  enum Priority
+  {
+    // Background recorders and thumbnails, only served when nothing else is waiting
+    LOW_PRIORITY,
+    NORMAL_PRIORITY,
+    // Operator views and snapshots
+    HIGH_PRIORITY,
+    PRIORITY_COUNT
+  };
+
+  /**
+   * @brief  Parses "low", "normal" or "high", returning default_priority for anything else
+   */
+  static Priority parsePriority(const std::string &name, Priority default_priority);
+
+  /**
+   * @class Queue
+   * @brief Runs the jobs of one stream one after another on the pool, keeping only the newest job that has not
+   *        started yet
+   */
+  class Queue : public boost::enable_shared_from_this<Queue>
+  {
+  public:
+    /**
+     * @brief  Queues job, replacing a job of this queue that is still waiting
+     */
+    void post(const Job &job);
+
+    /**
+     * @brief  Changes the priority the queue is scheduled with, from the next job on
+     */
+    void setPriority(Priority priority);
+
+  private:
+    friend class EncoderPool;
+
+    Queue(boost::weak_ptr<EncoderPool> pool, const boost::weak_ptr<void> &tracked_object, Priority priority);
+    // Runs the waiting job, returns true if another one was posted in the meantime
+    bool runNext();
+
+    boost::weak_ptr<EncoderPool> pool_;
+    boost::weak_ptr<void> tracked_object_;
+    // Read whenever the queue is scheduled, a job that is already waiting keeps its place
+    boost::atomic<int> priority_;
+    boost::mutex mutex_;
+    Job pending_job_;
+    // True from the time a job is posted until the queue runs out of jobs, so a queue is never run concurrently
+    bool scheduled_;
+  };
+  typedef boost::shared_ptr<Queue> QueuePtr;
+
+  EncoderPool(int threads);
+  ~EncoderPool();
+
+  /**
+   * @brief  Creates a queue whose jobs only run while tracked_object is alive
+   */
+  QueuePtr createQueue(const boost::weak_ptr<void> &tracked_object, Priority priority);
+
+  /**
+   * @brief  Parks a worker for every thread an encoder runs besides the worker calling it, so together they keep to
+   *         the size of the pool. At least one worker keeps running.
+   */
+  void reserveThreads(int threads);
+
+  /**
+   * @brief  Wakes up the workers parked by reserveThreads
+   */
+  void releaseThreads(int threads);
+
+private:
+  struct Worker
+  {
+    boost::mutex mutex;
+    // The owner takes queues from the front, other workers steal from the back
+    std::deque<QueuePtr> ready_queues[PRIORITY_COUNT];
+  };
+
+  // Adds a queue to the deque of the given worker
+  void schedule(const QueuePtr &queue, std::size_t worker_index);
+  // Takes the highest priority ready queue, preferring the worker's own deques over stealing
+  QueuePtr take(std::size_t worker_index);
+  // Returns true if the worker has to stay idle for threads reserved by encoders
+  bool isParked(std::size_t worker_index);
+  void run(std::size_t worker_index);
+
+  std::vector<boost::shared_ptr<Worker> > workers_;
+  // Number of queues waiting in all deques
+  boost::atomic<int> ready_count_;
+  // Spreads queues posted from outside the pool over the workers
+  boost::atomic<unsigned int> next_worker_;
+  // Threads reserved by encoders, the workers with the highest indices are parked for them
+  boost::atomic<int> reserved_threads_;
+  // Only used to sleep and wake up idle workers
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  bool stopped_;
+  boost::thread_group threads_;
+};
+
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef FRAME_BUFFER_H_
+#define FRAME_BUFFER_H_
+
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <vector>
+
+namespace web_video_server
+{
+
+/**
+ * Encoded data that is written to connections. The bytes are never changed once they are shared through a
+ * FrameBufferPtr, so a single copy serves every connection, each holding on to it as the resource of its write.
+ */
+typedef boost::shared_ptr<const std::vector<uint8_t> > FrameBufferPtr;
+
+}
+
+#endif
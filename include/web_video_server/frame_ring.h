@@ -0,0 +1,99 @@
+#ifndef FRAME_RING_H_
+#define FRAME_RING_H_
+
+#include <ros/ros.h>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+#include <vector>
+#include "web_video_server/frame_buffer.h"
+
+namespace web_video_server
+{
+
+/**
+ * @class FrameRing
+ * @brief A bounded ring of the most recent encoded frames of one stream. Every client reads it at its own pace
+ *        through a cursor holding the sequence number of the last frame it took, the producer never waits for them
+ *        and simply overwrites the oldest frame.
+ */
+class FrameRing
+{
+public:
+  struct Frame
+  {
+    FrameBufferPtr data;
+    ros::Time stamp;
+    bool key_frame;
+    // Sequence numbers start at 1, so a cursor of 0 has not read anything yet
+    uint64_t sequence;
+  };
+  typedef boost::shared_ptr<const Frame> FramePtr;
+  typedef boost::function<void()> Listener;
+
+  FrameRing(std::size_t capacity);
+
+  /**
+   * @brief  Stores a frame in place of the oldest one and calls the listeners, which should only poll for frames
+   *         without blocking
+   */
+  void publish(FrameBufferPtr data, const ros::Time &stamp, bool key_frame);
+
+  /**
+   * @brief  Stores a frame without calling the listeners, for producers that have to store under a lock of their own
+   *         and call notifyListeners once it is released
+   * @return the sequence number of the frame
+   */
+  uint64_t store(FrameBufferPtr data, const ros::Time &stamp, bool key_frame);
+
+  /**
+   * @brief  Calls the listeners, so they poll for frames stored since they last did
+   */
+  void notifyListeners();
+
+  /**
+   * @brief  Returns the sequence number of the newest frame, 0 if nothing has been published
+   */
+  uint64_t getHead() const;
+
+  /**
+   * @brief  Returns the frame with the given sequence number, or a null pointer if it has not been published yet or
+   *         has already been overwritten
+   */
+  FramePtr getFrame(uint64_t sequence) const;
+
+  /**
+   * @brief  Returns the newest keyframe still in the ring if it is newer than cursor
+   */
+  FramePtr getLatestKeyFrame(uint64_t cursor) const;
+
+  /**
+   * @brief  Returns the newest frame still in the ring that is newer than cursor and stamped no later than stamp
+   */
+  FramePtr getLatestUntil(uint64_t cursor, const ros::Time &stamp) const;
+
+  /**
+   * @brief  Calls listener after every published frame, until tracked_object is destroyed
+   */
+  void addListener(const Listener &listener, const boost::weak_ptr<void> &tracked_object);
+
+  /**
+   * @brief  Removes the listeners added for tracked_object
+   */
+  void removeListener(const boost::weak_ptr<void> &tracked_object);
+
+private:
+  // Slots are only accessed with atomic_load and atomic_store, so readers never lock
+  std::vector<FramePtr> slots_;
+  boost::atomic<uint64_t> head_;
+  // Serializes producers, readers never take it
+  boost::mutex publish_mutex_;
+  boost::mutex listeners_mutex_;
+  std::vector<std::pair<Listener, boost::weak_ptr<void> > > listeners_;
+};
+
+}
+
+#endif
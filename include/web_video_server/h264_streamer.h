@@ -0,0 +1,47 @@
+#ifndef H264_STREAMERS_H_
+#define H264_STREAMERS_H_
+
+#include <image_transport/image_transport.h>
+#include "web_video_server/libav_streamer.h"
+#include "async_web_server_cpp/http_request.hpp"
+#include "async_web_server_cpp/http_connection.hpp"
+
+namespace web_video_server
+{
+
+/**
+ * @class H264Streamer
+ * @brief Streams H.264 encoded by libx264 as fragmented MP4, with one fragment per frame so browsers can play it as it
+ *        arrives
+ */
+class H264Streamer : public LibavStreamer
+{
+public:
+  H264Streamer(const async_web_server_cpp::HttpRequest& request, async_web_server_cpp::HttpConnectionPtr connection,
+               ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub);
+  ~H264Streamer();
+protected:
+  virtual void initializeEncoder();
+  virtual void initializeMuxer(AVDictionary **options);
+  virtual int64_t getFramePts(double seconds_since_first_frame);
+private:
+  std::string preset_;
+  std::string tune_;
+  int crf_;
+  int64_t last_frame_pts_;
+};
+
+class H264StreamerType : public LibavStreamerType
+{
+public:
+  H264StreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, int encoder_threads);
+
+protected:
+  virtual boost::shared_ptr<LibavStreamer> create_libav_streamer(const async_web_server_cpp::HttpRequest& request,
+                                                                 async_web_server_cpp::HttpConnectionPtr connection,
+                                                                 ros::NodeHandle& nh);
+};
+
+}
+
+#endif
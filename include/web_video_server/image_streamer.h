@@ -4,22 +4,25 @@
 #include <ros/ros.h>
 #include <image_transport/image_transport.h>
 #include <opencv2/opencv.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include "web_video_server/image_topic_hub.h"
+#include "web_video_server/jpeg_decoder.h"
 #include "async_web_server_cpp/http_server.hpp"
 #include "async_web_server_cpp/http_request.hpp"
 
 namespace web_video_server
 {
 
-class ImageStreamer
+class ImageStreamer : public boost::enable_shared_from_this<ImageStreamer>
 {
 public:
   ImageStreamer(const async_web_server_cpp::HttpRequest &request,
 		async_web_server_cpp::HttpConnectionPtr connection,
-		ros::NodeHandle& nh);
+		ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub);
 
   virtual void start() = 0;
 
-  bool isInactive()
+  virtual bool isInactive()
   {
     return inactive_;
   }
@@ -30,13 +33,28 @@ public:
     return topic_;
   }
   ;
+
+  /**
+   * @brief  Limits the frame rate to max_fps unless the request sets max_fps itself, must be called before start
+   */
+  void setDefaultMaxFps(double max_fps);
 protected:
+  /**
+   * @brief  Returns false if a frame arriving now would exceed max_fps and should be dropped before any work is done
+   *         on it
+   */
+  bool acceptFrame();
+
   async_web_server_cpp::HttpConnectionPtr connection_;
   async_web_server_cpp::HttpRequest request_;
   ros::NodeHandle nh_;
+  boost::shared_ptr<ImageTopicHub> topic_hub_;
   bool inactive_;
-  image_transport::Subscriber image_sub_;
   std::string topic_;
+  double max_fps_;
+  ros::WallTime next_frame_time_;
+  // Priority of the stream's frames on the encoder pool
+  EncoderPool::Priority priority_;
 };
 
 
@@ -44,35 +62,80 @@ class ImageTransportImageStreamer : public ImageStreamer
 {
 public:
   ImageTransportImageStreamer(const async_web_server_cpp::HttpRequest &request, async_web_server_cpp::HttpConnectionPtr connection,
-			      ros::NodeHandle& nh);
+			      ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub);
 
   virtual void start();
 
 protected:
   virtual void sendImage(const cv::Mat &, const ros::Time &time) = 0;
 
-  virtual void initialize(const cv::Mat &);
+  /**
+   * @brief  Sends the image straight from the message buffer, without converting it to an OpenCV image first. Only
+   *         called when no rotation is needed.
+   * @return false if the streamer can not handle the image encoding and needs it converted
+   */
+  virtual bool sendRawImage(const sensor_msgs::ImageConstPtr &msg);
+
+  /**
+   * @brief  Called for every accepted frame before any work is done on it
+   * @return true if another stream sharing the encoder already encoded the frame, which skips converting and
+   *         sending it here
+   */
+  virtual bool isFrameEncoded(const ros::Time &time);
+
+  virtual void initialize();
+
+  void imageCallback(const sensor_msgs::ImageConstPtr &msg);
+  void compressedImageCallback(const sensor_msgs::CompressedImageConstPtr &msg);
 
-  image_transport::Subscriber image_sub_;
   int output_width_;
   int output_height_;
   bool invert_;
   std::string default_transport_;
+  // Encoder pool queue the images are handled on, set by start
+  EncoderPool::QueuePtr queue_;
 private:
-  image_transport::ImageTransport it_;
-  bool initialized_;
+  // Sets the output size from the input where the request left it open and initializes the streamer on first use
+  void prepareOutput(int input_width, int input_height);
+  // Inverts, resizes and sends an 8-bit mono, BGR or (with swap_rgb) RGB image
+  void processImage(const cv::Mat &img, bool swap_rgb, const ros::Time &time);
+  // Logs the exception being handled and ends the stream, only called from a catch block
+  void handleException();
+#ifdef HAVE_TURBOJPEG
+  boost::shared_ptr<JpegDecoder> jpeg_decoder_;
+#endif
 
-  void imageCallback(const sensor_msgs::ImageConstPtr &msg);
+  bool initialized_;
 };
 
 class ImageStreamerType
 {
 public:
+  ImageStreamerType() :
+      default_max_fps_(0)
+  {
+  }
+
+  virtual ~ImageStreamerType()
+  {
+  }
+
+  /**
+   * @brief  Sets the frame rate limit of the streams created from now on whose request does not set max_fps
+   */
+  void setDefaultMaxFps(double max_fps)
+  {
+    default_max_fps_ = max_fps;
+  }
+
   virtual boost::shared_ptr<ImageStreamer> create_streamer(const async_web_server_cpp::HttpRequest &request,
                                                            async_web_server_cpp::HttpConnectionPtr connection,
                                                            ros::NodeHandle& nh) = 0;
 
   virtual std::string create_viewer(const async_web_server_cpp::HttpRequest &request) = 0;
+
+protected:
+  double default_max_fps_;
 };
 
 }
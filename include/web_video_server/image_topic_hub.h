@@ -0,0 +1,123 @@
+#ifndef IMAGE_TOPIC_HUB_H_
+#define IMAGE_TOPIC_HUB_H_
+
+#include <ros/ros.h>
+#include <image_transport/image_transport.h>
+#include <sensor_msgs/CompressedImage.h>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+#include <map>
+#include <vector>
+#include "web_video_server/encoder_pool.h"
+
+namespace web_video_server
+{
+
+/**
+ * @class ImageTopicHub
+ * @brief Keeps a single ROS subscription per topic and hands every message to all streamers listening on it. The
+ *        streamers handle their messages on the encoder pool, one at a time, and a message still waiting there is
+ *        replaced by the next one.
+ */
+class ImageTopicHub
+{
+public:
+  typedef boost::function<void(const sensor_msgs::ImageConstPtr &)> ImageCallback;
+  typedef boost::function<void(const sensor_msgs::CompressedImageConstPtr &)> CompressedImageCallback;
+
+  ImageTopicHub(ros::NodeHandle &nh, boost::shared_ptr<EncoderPool> encoder_pool);
+
+  /**
+   * @brief  Calls callback for every image on topic received with the given image_transport transport, until
+   *         tracked_object is destroyed
+   * @param priority  priority of the callbacks on the encoder pool
+   * @return the encoder pool queue the callbacks run on
+   */
+  EncoderPool::QueuePtr subscribe(const std::string &topic, const std::string &transport, const ImageCallback &callback,
+                                  const boost::weak_ptr<void> &tracked_object,
+                                  EncoderPool::Priority priority = EncoderPool::NORMAL_PRIORITY);
+
+  /**
+   * @brief  Calls callback for every message on topic/compressed, until tracked_object is destroyed
+   * @param priority  priority of the callbacks on the encoder pool
+   * @return the encoder pool queue the callbacks run on
+   */
+  EncoderPool::QueuePtr subscribeCompressed(const std::string &topic, const CompressedImageCallback &callback,
+                                            const boost::weak_ptr<void> &tracked_object,
+                                            EncoderPool::Priority priority = EncoderPool::NORMAL_PRIORITY);
+
+  /**
+   * @brief  Creates an encoder pool queue for work that does not come from a subscription, such as handling a
+   *         cached message
+   */
+  EncoderPool::QueuePtr createQueue(const boost::weak_ptr<void> &tracked_object, EncoderPool::Priority priority);
+
+  boost::shared_ptr<EncoderPool> getEncoderPool()
+  {
+    return encoder_pool_;
+  }
+
+  /**
+   * @brief  Returns the last image received on a topic that currently has listeners
+   * @param max_age  maximum time in seconds since the image was received, negative to accept any age
+   * @return the image, or a null pointer if there is none recent enough
+   */
+  sensor_msgs::ImageConstPtr getLatestImage(const std::string &topic, const std::string &transport, double max_age);
+
+  /**
+   * @brief  Returns the last message received on topic/compressed, if the topic currently has listeners
+   * @param max_age  maximum time in seconds since the message was received, negative to accept any age
+   * @return the message, or a null pointer if there is none recent enough
+   */
+  sensor_msgs::CompressedImageConstPtr getLatestCompressedImage(const std::string &topic, double max_age);
+
+  /**
+   * @brief  Shuts down the subscriptions that no longer have any live listeners
+   */
+  void cleanup();
+
+private:
+  template<class M, class S>
+    struct Topic
+    {
+      typedef boost::shared_ptr<const M> MessageConstPtr;
+      typedef boost::function<void(const MessageConstPtr &)> Callback;
+      struct Listener
+      {
+        Callback callback;
+        boost::weak_ptr<void> tracked_object;
+        EncoderPool::QueuePtr queue;
+      };
+
+      void addListener(const Callback &callback, const boost::weak_ptr<void> &tracked_object,
+                       const EncoderPool::QueuePtr &queue);
+      void dispatch(const MessageConstPtr &msg);
+      bool hasListeners();
+      // Returns the last message if it was received at most max_age seconds ago
+      MessageConstPtr getLatest(double max_age);
+
+      S subscriber;
+      boost::mutex mutex;
+      std::vector<Listener> listeners;
+      MessageConstPtr latest;
+      ros::WallTime latest_receipt_time;
+    };
+
+  typedef Topic<sensor_msgs::Image, image_transport::Subscriber> ImageTopic;
+  typedef Topic<sensor_msgs::CompressedImage, ros::Subscriber> CompressedImageTopic;
+
+  template<class T>
+    static void removeUnused(std::map<std::string, boost::shared_ptr<T> > &topics);
+
+  ros::NodeHandle nh_;
+  image_transport::ImageTransport it_;
+  boost::shared_ptr<EncoderPool> encoder_pool_;
+  boost::mutex mutex_;
+  std::map<std::string, boost::shared_ptr<ImageTopic> > image_topics_;
+  std::map<std::string, boost::shared_ptr<CompressedImageTopic> > compressed_topics_;
+};
+
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef JPEG_DECODER_H_
+#define JPEG_DECODER_H_
+
+#ifdef HAVE_TURBOJPEG
+
+#include <opencv2/opencv.hpp>
+#include <turbojpeg.h>
+
+namespace web_video_server
+{
+
+/**
+ * @class JpegDecoder
+ * @brief Decodes JPEG images with libjpeg-turbo, scaling them down during decoding when a smaller image is wanted
+ */
+class JpegDecoder
+{
+public:
+  JpegDecoder();
+  ~JpegDecoder();
+
+  /**
+   * @brief  Reads the size of the image from its JPEG header, returns false if the data can not be decoded
+   */
+  bool readHeader(const unsigned char *data, unsigned long size, int &width, int &height);
+
+  /**
+   * @brief  Decodes the image at the smallest supported scaling factor (such as 1/2, 1/4 or 1/8) that keeps it at
+   *         least min_width x min_height. Grayscale images decode to a single channel, others to BGR.
+   */
+  void decode(const unsigned char *data, unsigned long size, int min_width, int min_height, cv::Mat &image);
+
+private:
+  tjhandle handle_;
+};
+
+}
+
+#endif
+
+#endif
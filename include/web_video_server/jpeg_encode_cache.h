@@ -0,0 +1,77 @@
+#ifndef JPEG_ENCODE_CACHE_H_
+#define JPEG_ENCODE_CACHE_H_
+
+#include <ros/ros.h>
+#include <opencv2/opencv.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/weak_ptr.hpp>
+#include <map>
+#include <vector>
+#include "web_video_server/jpeg_encoder.h"
+#include "web_video_server/buffer_pool.h"
+#include "web_video_server/frame_ring.h"
+
+namespace web_video_server
+{
+
+/**
+ * @class JpegEncodeCache
+ * @brief Shares encoded JPEG frames between streamers that watch the same topic with the same output settings
+ */
+class JpegEncodeCache
+{
+public:
+  class Entry
+  {
+  public:
+    Entry(int quality, boost::shared_ptr<JpegEncoder> encoder, boost::shared_ptr<BufferPool> buffer_pool);
+
+    /**
+     * @brief  Returns the JPEG encoding of img, reusing the last encoded frame if it has the same timestamp. Newly
+     *         encoded frames are also published to the ring.
+     */
+    FrameBufferPtr encode(const cv::Mat &img, const ros::Time &time);
+
+    /**
+     * @brief  Returns the last encoded frame if it has the given timestamp, so callers can skip preparing the image
+     */
+    FrameBufferPtr getFrame(const ros::Time &time);
+
+    /**
+     * @brief  Returns the ring the streams sharing this entry read their frames from
+     */
+    boost::shared_ptr<FrameRing> getRing();
+
+  private:
+    const int quality_;
+    boost::shared_ptr<JpegEncoder> encoder_;
+    boost::shared_ptr<BufferPool> buffer_pool_;
+    boost::mutex mutex_;
+    ros::Time last_time_;
+    FrameBufferPtr last_frame_;
+    boost::shared_ptr<FrameRing> ring_;
+  };
+  typedef boost::shared_ptr<Entry> EntryPtr;
+
+  JpegEncodeCache(boost::shared_ptr<JpegEncoder> encoder);
+
+  /**
+   * @brief  Returns the entry shared by all streamers with the given settings, the entry lives as long as a streamer
+   *         holds on to it
+   */
+  EntryPtr getEntry(const std::string &topic, int width, int height, int quality, bool invert);
+
+private:
+  typedef boost::tuple<std::string, int, int, int, bool> Key;
+
+  boost::shared_ptr<JpegEncoder> encoder_;
+  // Encoded frames are recycled once every connection has written them
+  boost::shared_ptr<BufferPool> buffer_pool_;
+  boost::mutex mutex_;
+  std::map<Key, boost::weak_ptr<Entry> > entries_;
+};
+
+}
+
+#endif
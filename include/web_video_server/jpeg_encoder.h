@@ -0,0 +1,69 @@
+#ifndef JPEG_ENCODER_H_
+#define JPEG_ENCODER_H_
+
+#include <ros/ros.h>
+#include <opencv2/opencv.hpp>
+#include <boost/thread/tss.hpp>
+#include <vector>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+namespace web_video_server
+{
+
+/**
+ * @class JpegEncoder
+ * @brief Backend used to compress images to JPEG
+ */
+class JpegEncoder
+{
+public:
+  virtual ~JpegEncoder()
+  {
+  }
+
+  virtual void encode(const cv::Mat &img, int quality, std::vector<unsigned char> &buffer) = 0;
+
+  /**
+   * @brief  Creates the encoder selected by the jpeg_encoder parameter ("opencv" or "turbojpeg")
+   */
+  static boost::shared_ptr<JpegEncoder> create(ros::NodeHandle &private_nh);
+};
+
+class OpenCvJpegEncoder : public JpegEncoder
+{
+public:
+  virtual void encode(const cv::Mat &img, int quality, std::vector<unsigned char> &buffer);
+};
+
+#ifdef HAVE_TURBOJPEG
+class TurboJpegEncoder : public JpegEncoder
+{
+public:
+  TurboJpegEncoder(int subsampling, bool fast_dct);
+
+  virtual void encode(const cv::Mat &img, int quality, std::vector<unsigned char> &buffer);
+
+private:
+  // Compressor handle and output buffer reused by every encode on the same thread
+  struct ThreadState
+  {
+    ThreadState();
+    ~ThreadState();
+
+    tjhandle handle;
+    unsigned char *buffer;
+    unsigned long buffer_size;
+  };
+
+  int subsampling_;
+  int flags_;
+  boost::thread_specific_ptr<ThreadState> thread_state_;
+};
+#endif
+
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include "async_web_server_cpp/http_request.hpp"
 #include "async_web_server_cpp/http_connection.hpp"
 #include "web_video_server/multipart_stream.h"
+#include "web_video_server/jpeg_encode_cache.h"
 
 namespace web_video_server
 {
@@ -14,36 +15,73 @@ class MjpegStreamer : public ImageTransportImageStreamer
 {
 public:
   MjpegStreamer(const async_web_server_cpp::HttpRequest &request, async_web_server_cpp::HttpConnectionPtr connection,
-                ros::NodeHandle& nh);
+                ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub,
+                boost::shared_ptr<JpegEncodeCache> encode_cache);
 
 protected:
+  virtual void initialize();
+  virtual bool isFrameEncoded(const ros::Time &time);
   virtual void sendImage(const cv::Mat &, const ros::Time &time);
 
 private:
+  // Switches to the cache entry for current_quality_ and reads its ring from the next frame on
+  void attachEntry();
+  // Sends the newest frame of the ring if the client has received everything sent before
+  void pollRing();
+  void updateQuality(std::size_t frame_size);
+
   MultipartStream stream_;
   int quality_;
+  boost::shared_ptr<JpegEncodeCache> encode_cache_;
+  // Guards everything below, pollRing runs on whichever thread published a frame or drained the connection
+  boost::mutex ring_mutex_;
+  JpegEncodeCache::EntryPtr encode_cache_entry_;
+  boost::shared_ptr<FrameRing> ring_;
+  uint64_t ring_cursor_;
+  // Stamp of the newest frame this stream accepted, the ring also holds frames only other streams wanted
+  ros::Time accepted_stamp_;
+
+  // Rate control, quality_ is the upper limit when a bitrate is requested
+  int bitrate_;
+  int current_quality_;
+  double average_frame_size_;
+  double average_frame_interval_;
+  ros::WallTime last_frame_time_;
 };
 
 class MjpegStreamerType : public ImageStreamerType
 {
 public:
+  MjpegStreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, boost::shared_ptr<JpegEncodeCache> encode_cache);
+
   boost::shared_ptr<ImageStreamer> create_streamer(const async_web_server_cpp::HttpRequest &request,
                                                    async_web_server_cpp::HttpConnectionPtr connection,
                                                    ros::NodeHandle& nh);
   std::string create_viewer(const async_web_server_cpp::HttpRequest &request);
+
+private:
+  boost::shared_ptr<ImageTopicHub> topic_hub_;
+  boost::shared_ptr<JpegEncodeCache> encode_cache_;
 };
 
 class JpegSnapshotStreamer : public ImageTransportImageStreamer
 {
 public:
   JpegSnapshotStreamer(const async_web_server_cpp::HttpRequest &request,
-                       async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh);
+                       async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                       boost::shared_ptr<ImageTopicHub> topic_hub, boost::shared_ptr<JpegEncodeCache> encode_cache);
+
+  virtual void start();
 
 protected:
+  virtual void initialize();
   virtual void sendImage(const cv::Mat &, const ros::Time &time);
 
 private:
   int quality_;
+  double max_age_;
+  boost::shared_ptr<JpegEncodeCache> encode_cache_;
+  JpegEncodeCache::EntryPtr encode_cache_entry_;
 };
 
 }
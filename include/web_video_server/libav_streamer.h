@@ -3,6 +3,9 @@
 
 #include <image_transport/image_transport.h>
 #include "web_video_server/image_streamer.h"
+#include "web_video_server/buffer_pool.h"
+#include "web_video_server/frame_ring.h"
+#include "web_video_server/throttled_connection.h"
 #include "async_web_server_cpp/http_request.hpp"
 #include "async_web_server_cpp/http_connection.hpp"
 
@@ -24,27 +27,106 @@ class LibavStreamer : public ImageTransportImageStreamer
 {
 public:
   LibavStreamer(const async_web_server_cpp::HttpRequest &request, async_web_server_cpp::HttpConnectionPtr connection,
-                ros::NodeHandle& nh, const std::string &format_name, const std::string &codec_name,
-                const std::string &content_type);
+                ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub, const std::string &format_name,
+                const std::string &codec_name, const std::string &content_type);
 
   ~LibavStreamer();
 
+  virtual void start();
+
+  /**
+   * @brief  Adds another client to this encoder. Clients joining an already running stream are sent the cached
+   *         stream header and start reading the ring at the next keyframe, which is requested right away. The
+   *         encoder runs at the highest priority of its clients.
+   * @return false if the encoder has already shut down, or its clients can not join at a keyframe
+   */
+  bool addConnection(async_web_server_cpp::HttpConnectionPtr connection, EncoderPool::Priority priority);
+
+  bool hasConnection(async_web_server_cpp::HttpConnectionPtr connection);
+
+  /**
+   * @brief  Sets the number of threads all libav streams together may add to the worker threads calling their
+   *         encoders
+   */
+  static void setThreadBudget(int threads);
+
 protected:
   virtual void initializeEncoder();
+  /**
+   * @brief  Sets the options the stream header is written with, called after the codec is opened
+   */
+  virtual void initializeMuxer(AVDictionary **options);
+  /**
+   * @brief  Returns the timestamp passed to the encoder for a frame, in codec_context_->time_base units
+   */
+  virtual int64_t getFramePts(double seconds_since_first_frame);
+  /**
+   * @brief  Reserves encoder threads from the budget shared by all libav streams until this streamer is destroyed.
+   *         A requested count of 0 sizes it from the output resolution. Either count is limited to the calling
+   *         worker thread plus what is left of the budget.
+   * @return the number of threads to encode with, at least 1
+   */
+  int reserveThreads(int requested);
   virtual void sendImage(const cv::Mat&, const ros::Time& time);
-  virtual void initialize(const cv::Mat&);
+  virtual bool sendRawImage(const sensor_msgs::ImageConstPtr &msg);
+  virtual void initialize();
   AVOutputFormat* output_format_;
   AVFormatContext* format_context_;
   AVCodec* codec_;
   AVCodecContext* codec_context_;
   AVStream* video_stream_;
+  // Flush the muxer after every frame, for formats that otherwise buffer several frames. Shared streams need this, a
+  // client can only join at a keyframe that starts a new cluster or fragment.
+  bool flush_every_frame_;
 
 private:
+  struct Sink
+  {
+    async_web_server_cpp::HttpConnectionPtr connection;
+    boost::shared_ptr<ThrottledConnection> throttled_connection;
+    // Sequence number of the last frame written to the client
+    uint64_t cursor;
+    bool waiting_for_keyframe;
+    EncoderPool::Priority priority;
+  };
+  typedef boost::shared_ptr<Sink> SinkPtr;
+
+#if (LIBAVUTIL_VERSION_MAJOR < 52)
+  void convertImage(const uint8_t *data, int step, PixelFormat format, int width, int height);
+#else
+  void convertImage(const uint8_t *data, int step, AVPixelFormat format, int width, int height);
+#endif
+  void encodeFrame(const ros::Time &time);
+  // Returns false if every client is still busy with frames it has not read yet
+  bool prepareSinks();
+  void sendStreamHeader(const SinkPtr &sink);
+  // Writes frames from the ring for as long as the client takes them, called with sinks_mutex_ held
+  void pollSink(Sink &sink);
+  void pollSinks();
+  void sinkReady(boost::weak_ptr<Sink> weak_sink);
+  // Moves the encoder to the highest priority of its clients, called with sinks_mutex_ held
+  void updatePriority();
+  static int writePacket(void *opaque, uint8_t *buf, int buf_size);
+
+  // Encoded frames, every client reads them at its own pace
+  boost::shared_ptr<FrameRing> ring_;
+  // Guards the sinks and the header, never held while encoding
+  boost::mutex sinks_mutex_;
+  std::vector<SinkPtr> sinks_;
+  FrameBufferPtr header_buffer_;
+  boost::atomic<bool> force_keyframe_;
+  // Set once start has subscribed, clients joining before that are taken into account by start
+  bool subscribed_;
+
   AVFrame* frame_;
   AVPicture* picture_;
   AVPicture* tmp_picture_;
   struct SwsContext* sws_context_;
   ros::Time first_image_timestamp_;
+  int64_t last_packet_pts_;
+  int reserved_threads_;
+  // Parks a pool worker for every reserved thread, weak so a streamer released on a worker never destroys the pool
+  boost::weak_ptr<EncoderPool> encoder_pool_;
   boost::mutex encode_mutex_;
 
   std::string format_name_;
@@ -54,12 +136,40 @@ private:
   int qmin_;
   int qmax_;
   int gop_;
+
+  boost::shared_ptr<BufferPool> buffer_pool_;
+  // Buffer the muxer output is currently collected in
+  BufferPool::BufferPtr output_buffer_;
+
+  static boost::mutex thread_budget_mutex_;
+  static int thread_budget_;
+  static int threads_in_use_;
+};
+
+/**
+ * @class SharedLibavStreamer
+ * @brief A client watching the output of a LibavStreamer that was started for another client with the same settings
+ */
+class SharedLibavStreamer : public ImageStreamer
+{
+public:
+  SharedLibavStreamer(const async_web_server_cpp::HttpRequest &request,
+                      async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                      boost::shared_ptr<ImageTopicHub> topic_hub, boost::shared_ptr<LibavStreamer> encoder);
+
+  virtual void start();
+
+  virtual bool isInactive();
+
+private:
+  boost::shared_ptr<LibavStreamer> encoder_;
 };
 
 class LibavStreamerType : public ImageStreamerType
 {
 public:
-  LibavStreamerType(const std::string &format_name, const std::string &codec_name, const std::string &content_type);
+  LibavStreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, const std::string &format_name,
+                    const std::string &codec_name, const std::string &content_type, int encoder_threads);
 
   boost::shared_ptr<ImageStreamer> create_streamer(const async_web_server_cpp::HttpRequest &request,
                                                    async_web_server_cpp::HttpConnectionPtr connection,
@@ -67,10 +177,22 @@ public:
 
   std::string create_viewer(const async_web_server_cpp::HttpRequest &request);
 
+protected:
+  virtual boost::shared_ptr<LibavStreamer> create_libav_streamer(const async_web_server_cpp::HttpRequest &request,
+                                                                 async_web_server_cpp::HttpConnectionPtr connection,
+                                                                 ros::NodeHandle& nh);
+
+  boost::shared_ptr<ImageTopicHub> topic_hub_;
+
 private:
+  std::string shared_encoder_key(const async_web_server_cpp::HttpRequest &request);
+
   const std::string format_name_;
   const std::string codec_name_;
   const std::string content_type_;
+
+  boost::mutex shared_encoders_mutex_;
+  std::map<std::string, boost::weak_ptr<LibavStreamer> > shared_encoders_;
 };
 
 }
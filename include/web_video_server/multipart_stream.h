@@ -3,6 +3,8 @@
 
 #include <ros/ros.h>
 #include <async_web_server_cpp/http_connection.hpp>
+#include "web_video_server/throttled_connection.h"
+#include "web_video_server/buffer_pool.h"
 
 namespace web_video_server
 {
@@ -12,15 +14,52 @@ public:
   MultipartStream(async_web_server_cpp::HttpConnectionPtr& connection, const std::string& boundry="boundarydonotcross");
 
   void sendInitialHeader();
-  void sendPartHeader(const ros::Time &time, const std::string& type, size_t payload_size);
-  void sendPartFooter();
-  void sendPartAndClear(const ros::Time &time, const std::string& type, std::vector<unsigned char> &data);
+  /**
+   * @brief  Sends the part in a single write once the connection has drained, a newer part replaces a part that is
+   *         still waiting
+   */
+  void sendPart(const ros::Time &time, const std::string& type, FrameBufferPtr frame);
   void sendPart(const ros::Time &time, const std::string& type, const boost::asio::const_buffer &buffer,
 		async_web_server_cpp::HttpConnection::ResourcePtr resource);
+  /**
+   * @brief  Sends a part whose payload is spread over several buffers, all kept alive by resource
+   */
+  void sendPart(const ros::Time &time, const std::string& type, const std::vector<boost::asio::const_buffer> &payload,
+		async_web_server_cpp::HttpConnection::ResourcePtr resource);
+  /**
+   * @brief  Returns the rate in bytes per second the client has been receiving parts at, 0 if unknown
+   */
+  double getDrainRate();
+  /**
+   * @brief  Returns true if a part sent now is written right away, throws boost::system::system_error if the
+   *         connection failed
+   */
+  bool isReady();
+  /**
+   * @brief  Calls callback whenever the client has received everything sent so far, until tracked_object is destroyed
+   */
+  void setReadyCallback(const boost::function<void()> &callback, const boost::weak_ptr<void> &tracked_object);
 
 private:
+  struct PartResources
+  {
+    BufferPool::BufferPtr header;
+    async_web_server_cpp::HttpConnection::ResourcePtr payload;
+    async_web_server_cpp::HttpConnection::ResourcePtr footer;
+  };
+
+  static void appendString(std::vector<uint8_t> &buffer, const char *str);
+  static void appendDecimal(std::vector<uint8_t> &buffer, uint64_t value, int min_digits = 1);
+  static void appendTimestamp(std::vector<uint8_t> &buffer, const ros::Time &time);
+
   async_web_server_cpp::HttpConnectionPtr connection_;
+  boost::shared_ptr<ThrottledConnection> throttled_connection_;
   std::string boundry_;
+  boost::shared_ptr<const std::string> part_footer_;
+  boost::shared_ptr<BufferPool> header_pool_;
+  // Part header up to the timestamp, for the content type of the last part
+  std::string part_header_type_;
+  std::string part_header_prefix_;
 };
 
 }
@@ -0,0 +1,61 @@
+#ifndef RAW_STREAMERS_H_
+#define RAW_STREAMERS_H_
+
+#include <image_transport/image_transport.h>
+#include "web_video_server/image_streamer.h"
+#include "web_video_server/buffer_pool.h"
+#include "async_web_server_cpp/http_request.hpp"
+#include "async_web_server_cpp/http_connection.hpp"
+#include "web_video_server/multipart_stream.h"
+
+namespace web_video_server
+{
+
+/**
+ * @class RawStreamer
+ * @brief Streams unencoded images as multipart parts of type application/octet-stream, for machine consumers on fast
+ *        networks. Each part holds a little endian header followed by the pixel data:
+ *
+ *        uint32 width, uint32 height, uint32 step, uint32 stamp_sec, uint32 stamp_nsec,
+ *        uint32 data_size (uncompressed), uint8 is_bigendian, uint8 compression (0 none, 1 LZ4 block),
+ *        uint8 encoding_length, char encoding[encoding_length]
+ *
+ *        Images that need no resizing or rotation are sent straight from the message buffer.
+ */
+class RawStreamer : public ImageTransportImageStreamer
+{
+public:
+  RawStreamer(const async_web_server_cpp::HttpRequest &request, async_web_server_cpp::HttpConnectionPtr connection,
+              ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub);
+
+protected:
+  virtual void sendImage(const cv::Mat &, const ros::Time &time);
+  virtual bool sendRawImage(const sensor_msgs::ImageConstPtr &msg);
+
+private:
+  void sendFrame(uint32_t width, uint32_t height, uint32_t step, const std::string &encoding, bool is_bigendian,
+                 const ros::Time &time, const uint8_t *data, std::size_t size,
+                 async_web_server_cpp::HttpConnection::ResourcePtr resource);
+
+  MultipartStream stream_;
+  bool lz4_;
+  boost::shared_ptr<BufferPool> buffer_pool_;
+};
+
+class RawStreamerType : public ImageStreamerType
+{
+public:
+  RawStreamerType(boost::shared_ptr<ImageTopicHub> topic_hub);
+
+  boost::shared_ptr<ImageStreamer> create_streamer(const async_web_server_cpp::HttpRequest &request,
+                                                   async_web_server_cpp::HttpConnectionPtr connection,
+                                                   ros::NodeHandle& nh);
+  std::string create_viewer(const async_web_server_cpp::HttpRequest &request);
+
+private:
+  boost::shared_ptr<ImageTopicHub> topic_hub_;
+};
+
+}
+
+#endif
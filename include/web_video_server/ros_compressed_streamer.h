@@ -6,6 +6,8 @@
 #include "async_web_server_cpp/http_request.hpp"
 #include "async_web_server_cpp/http_connection.hpp"
 #include "web_video_server/multipart_stream.h"
+#include "web_video_server/jpeg_encode_cache.h"
+#include "web_video_server/jpeg_decoder.h"
 
 namespace web_video_server
 {
@@ -14,23 +16,48 @@ class RosCompressedStreamer : public ImageStreamer
 {
 public:
   RosCompressedStreamer(const async_web_server_cpp::HttpRequest &request, async_web_server_cpp::HttpConnectionPtr connection,
-			ros::NodeHandle& nh);
+			ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub,
+			boost::shared_ptr<JpegEncodeCache> encode_cache);
   virtual void start();
 
 private:
   void imageCallback(const sensor_msgs::CompressedImageConstPtr &msg);
+  /**
+   * @brief  Sends the image scaled and re-encoded to the requested size and quality
+   * @return false if the image already matches the request and can be passed through
+   */
+  bool sendTranscoded(const sensor_msgs::CompressedImageConstPtr &msg);
 
   MultipartStream stream_;
-  ros::Subscriber image_sub_;
+
+  // Transcoding settings, -1 keeps the size of the incoming images
+  bool transcode_;
+  int output_width_;
+  int output_height_;
+  bool has_quality_;
+  int quality_;
+  boost::shared_ptr<JpegEncodeCache> encode_cache_;
+  JpegEncodeCache::EntryPtr encode_cache_entry_;
+  cv::Size encode_cache_entry_size_;
+#ifdef HAVE_TURBOJPEG
+  boost::shared_ptr<JpegDecoder> jpeg_decoder_;
+#endif
 };
 
 class RosCompressedStreamerType : public ImageStreamerType
 {
 public:
+  RosCompressedStreamerType(boost::shared_ptr<ImageTopicHub> topic_hub,
+                            boost::shared_ptr<JpegEncodeCache> encode_cache);
+
   boost::shared_ptr<ImageStreamer> create_streamer(const async_web_server_cpp::HttpRequest &request,
                                                    async_web_server_cpp::HttpConnectionPtr connection,
                                                    ros::NodeHandle& nh);
   std::string create_viewer(const async_web_server_cpp::HttpRequest &request);
+
+private:
+  boost::shared_ptr<ImageTopicHub> topic_hub_;
+  boost::shared_ptr<JpegEncodeCache> encode_cache_;
 };
 
 }
@@ -0,0 +1,81 @@
+#ifndef THROTTLED_CONNECTION_H_
+#define THROTTLED_CONNECTION_H_
+
+#include <ros/ros.h>
+#include <async_web_server_cpp/http_connection.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/weak_ptr.hpp>
+#include <vector>
+
+namespace web_video_server
+{
+
+/**
+ * @class ThrottledConnection
+ * @brief Tracks the bytes in flight on a connection and holds back frames while the client is still receiving older
+ *        ones, keeping at most one pending frame so slow clients get a lower frame rate instead of growing latency
+ */
+class ThrottledConnection : public boost::enable_shared_from_this<ThrottledConnection>
+{
+public:
+  ThrottledConnection(async_web_server_cpp::HttpConnectionPtr connection);
+
+  /**
+   * @brief  Writes the data right away, for data that must never be dropped such as stream headers
+   */
+  void write(const std::vector<boost::asio::const_buffer> &buffers,
+             async_web_server_cpp::HttpConnection::ResourcePtr resource);
+
+  /**
+   * @brief  Writes the frame if nothing is in flight, otherwise keeps it until the connection drains, replacing any
+   *         frame that is already pending
+   */
+  void sendFrame(const std::vector<boost::asio::const_buffer> &buffers,
+                 async_web_server_cpp::HttpConnection::ResourcePtr resource);
+
+  /**
+   * @brief  Returns true if nothing is in flight, throws boost::system::system_error if the connection failed
+   */
+  bool isReady();
+
+  /**
+   * @brief  Returns the rate in bytes per second the connection has been taking data at while data queued on it, 0
+   *         if the last write went through without queuing
+   */
+  double getDrainRate();
+
+  /**
+   * @brief  Calls callback whenever the connection drains without a pending frame to send next, until
+   *         tracked_object is destroyed. The callback runs on whichever thread completed the last write.
+   */
+  void setReadyCallback(const boost::function<void()> &callback, const boost::weak_ptr<void> &tracked_object);
+
+private:
+  class WriteTracker;
+
+  static void writeCompleted(boost::weak_ptr<ThrottledConnection> weak_this, std::size_t size);
+  void writeTracked(const std::vector<boost::asio::const_buffer> &buffers,
+                    async_web_server_cpp::HttpConnection::ResourcePtr resource);
+  void checkConnection();
+  void startWrite(std::size_t size);
+
+  async_web_server_cpp::HttpConnectionPtr connection_;
+  boost::mutex mutex_;
+  std::size_t bytes_in_flight_;
+  // Bytes written since the connection last became busy
+  std::size_t bytes_drained_;
+  ros::WallTime busy_since_;
+  double drain_rate_;
+  bool has_pending_frame_;
+  std::vector<boost::asio::const_buffer> pending_buffers_;
+  async_web_server_cpp::HttpConnection::ResourcePtr pending_resource_;
+  boost::system::error_code error_;
+  boost::function<void()> ready_callback_;
+  boost::weak_ptr<void> ready_tracked_object_;
+};
+
+}
+
+#endif
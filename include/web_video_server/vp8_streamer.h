@@ -49,21 +49,27 @@ class Vp8Streamer : public LibavStreamer
 {
 public:
   Vp8Streamer(const async_web_server_cpp::HttpRequest& request, async_web_server_cpp::HttpConnectionPtr connection,
-              ros::NodeHandle& nh);
+              ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub);
   ~Vp8Streamer();
 protected:
   virtual void initializeEncoder();
 private:
   std::string quality_;
+  // 0 picks a value from the output size
+  int threads_;
+  int token_partitions_;
+  std::string cpu_used_;
 };
 
 class Vp8StreamerType : public LibavStreamerType
 {
 public:
-  Vp8StreamerType();
-  virtual boost::shared_ptr<ImageStreamer> create_streamer(const async_web_server_cpp::HttpRequest& request,
-                                                           async_web_server_cpp::HttpConnectionPtr connection,
-                                                           ros::NodeHandle& nh);
+  Vp8StreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, int encoder_threads);
+
+protected:
+  virtual boost::shared_ptr<LibavStreamer> create_libav_streamer(const async_web_server_cpp::HttpRequest& request,
+                                                                 async_web_server_cpp::HttpConnectionPtr connection,
+                                                                 ros::NodeHandle& nh);
 };
 
 }
@@ -0,0 +1,45 @@
+#ifndef VP9_STREAMERS_H_
+#define VP9_STREAMERS_H_
+
+#include <image_transport/image_transport.h>
+#include "web_video_server/libav_streamer.h"
+#include "async_web_server_cpp/http_request.hpp"
+#include "async_web_server_cpp/http_connection.hpp"
+
+namespace web_video_server
+{
+
+/**
+ * @class Vp9Streamer
+ * @brief Streams WebM encoded by libvpx-vp9 in realtime mode, with row based multi-threading
+ */
+class Vp9Streamer : public LibavStreamer
+{
+public:
+  Vp9Streamer(const async_web_server_cpp::HttpRequest& request, async_web_server_cpp::HttpConnectionPtr connection,
+              ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub);
+  ~Vp9Streamer();
+protected:
+  virtual void initializeEncoder();
+private:
+  // 0 picks a value from the output size
+  int threads_;
+  // log2 of the number of tile columns
+  int tile_columns_;
+  std::string cpu_used_;
+};
+
+class Vp9StreamerType : public LibavStreamerType
+{
+public:
+  Vp9StreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, int encoder_threads);
+
+protected:
+  virtual boost::shared_ptr<LibavStreamer> create_libav_streamer(const async_web_server_cpp::HttpRequest& request,
+                                                                 async_web_server_cpp::HttpConnectionPtr connection,
+                                                                 ros::NodeHandle& nh);
+};
+
+}
+
+#endif
@@ -5,6 +5,8 @@
 #include <cv_bridge/cv_bridge.h>
 #include <vector>
 #include "web_video_server/image_streamer.h"
+#include "web_video_server/image_topic_hub.h"
+#include "web_video_server/jpeg_encode_cache.h"
 #include "async_web_server_cpp/http_server.hpp"
 #include "async_web_server_cpp/http_request.hpp"
 #include "async_web_server_cpp/http_connection.hpp"
@@ -49,6 +51,8 @@ public:
 
 private:
   void cleanup_inactive_streams();
+  // True if an mjpeg request can be served from the topic's JPEG compressed images as they are
+  bool can_pass_through_compressed(const async_web_server_cpp::HttpRequest &request);
 
   ros::NodeHandle nh_;
   ros::Timer cleanup_timer_;
@@ -58,6 +62,9 @@ private:
   boost::shared_ptr<async_web_server_cpp::HttpServer> server_;
   async_web_server_cpp::HttpRequestHandlerGroup handler_group_;
 
+  boost::shared_ptr<ImageTopicHub> topic_hub_;
+  boost::shared_ptr<JpegEncodeCache> jpeg_encode_cache_;
+
   std::vector<boost::shared_ptr<ImageStreamer> > image_subscribers_;
   std::map<std::string, boost::shared_ptr<ImageStreamerType> > stream_types_;
   boost::mutex subscriber_mutex_;
@@ -0,0 +1,60 @@
+#include "web_video_server/buffer_pool.h"
+
+namespace web_video_server
+{
+
+BufferPool::Recycler::Recycler(boost::weak_ptr<BufferPool> pool) :
+    pool_(pool)
+{
+}
+
+void BufferPool::Recycler::operator()(std::vector<uint8_t> *buffer)
+{
+  boost::shared_ptr<BufferPool> pool = pool_.lock();
+  if (pool)
+    pool->release(buffer);
+  else
+    delete buffer;
+}
+
+BufferPool::BufferPool(std::size_t max_free_buffers) :
+    max_free_buffers_(max_free_buffers)
+{
+}
+
+BufferPool::~BufferPool()
+{
+  for (std::vector<std::vector<uint8_t>*>::iterator itr = free_buffers_.begin(); itr != free_buffers_.end(); ++itr)
+  {
+    delete *itr;
+  }
+}
+
+BufferPool::BufferPtr BufferPool::acquire()
+{
+  std::vector<uint8_t> *buffer = NULL;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (!free_buffers_.empty())
+    {
+      buffer = free_buffers_.back();
+      free_buffers_.pop_back();
+    }
+  }
+  if (!buffer)
+    buffer = new std::vector<uint8_t>();
+  return BufferPtr(buffer, Recycler(shared_from_this()));
+}
+
+void BufferPool::release(std::vector<uint8_t> *buffer)
+{
+  // Keep the capacity so the next frame does not have to grow the buffer again
+  buffer->clear();
+  boost::mutex::scoped_lock lock(mutex_);
+  if (free_buffers_.size() < max_free_buffers_)
+    free_buffers_.push_back(buffer);
+  else
+    delete buffer;
+}
+
+}
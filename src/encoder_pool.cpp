@@ -0,0 +1,198 @@
+#include "web_video_server/encoder_pool.h"
+#include <ros/ros.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+
+namespace web_video_server
+{
+
+EncoderPool::Priority EncoderPool::parsePriority(const std::string &name, Priority default_priority)
+{
+  if (name == "low")
+    return LOW_PRIORITY;
+  if (name == "normal")
+    return NORMAL_PRIORITY;
+  if (name == "high")
+    return HIGH_PRIORITY;
+  return default_priority;
+}
+
+EncoderPool::Queue::Queue(boost::weak_ptr<EncoderPool> pool, const boost::weak_ptr<void> &tracked_object,
+                          Priority priority) :
+    pool_(pool), tracked_object_(tracked_object), priority_(priority), scheduled_(false)
+{
+}
+
+void EncoderPool::Queue::post(const Job &job)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_job_ = job;
+    // A scheduled queue picks up the new job by itself
+    if (scheduled_)
+      return;
+    scheduled_ = true;
+  }
+  boost::shared_ptr<EncoderPool> pool = pool_.lock();
+  if (pool)
+    pool->schedule(shared_from_this(), pool->next_worker_++ % pool->workers_.size());
+}
+
+void EncoderPool::Queue::setPriority(Priority priority)
+{
+  priority_ = priority;
+}
+
+bool EncoderPool::Queue::runNext()
+{
+  Job job;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    job.swap(pending_job_);
+  }
+
+  boost::shared_ptr<void> tracked_object = tracked_object_.lock();
+  if (job && tracked_object)
+  {
+    try
+    {
+      job();
+    }
+    catch (std::exception &e)
+    {
+      ROS_ERROR_THROTTLE(30, "exception: %s", e.what());
+    }
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  if (!pending_job_)
+  {
+    scheduled_ = false;
+    return false;
+  }
+  return true;
+}
+
+EncoderPool::EncoderPool(int threads) :
+    ready_count_(0), next_worker_(0), reserved_threads_(0), stopped_(false)
+{
+  for (int i = 0; i < std::max(threads, 1); ++i)
+  {
+    workers_.push_back(boost::shared_ptr<Worker>(new Worker()));
+  }
+  for (std::size_t i = 0; i < workers_.size(); ++i)
+  {
+    threads_.create_thread(boost::bind(&EncoderPool::run, this, i));
+  }
+}
+
+EncoderPool::~EncoderPool()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stopped_ = true;
+  }
+  condition_.notify_all();
+  threads_.join_all();
+}
+
+EncoderPool::QueuePtr EncoderPool::createQueue(const boost::weak_ptr<void> &tracked_object, Priority priority)
+{
+  return QueuePtr(new Queue(shared_from_this(), tracked_object, priority));
+}
+
+void EncoderPool::reserveThreads(int threads)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  reserved_threads_ += threads;
+}
+
+void EncoderPool::releaseThreads(int threads)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    reserved_threads_ -= threads;
+  }
+  condition_.notify_all();
+}
+
+bool EncoderPool::isParked(std::size_t worker_index)
+{
+  int active_workers = std::max((int)workers_.size() - reserved_threads_.load(), 1);
+  return (int)worker_index >= active_workers;
+}
+
+void EncoderPool::schedule(const QueuePtr &queue, std::size_t worker_index)
+{
+  {
+    Worker &worker = *workers_[worker_index];
+    boost::mutex::scoped_lock lock(worker.mutex);
+    worker.ready_queues[queue->priority_.load()].push_back(queue);
+  }
+  ++ready_count_;
+  // Taking the lock makes sure a worker about to sleep either sees the count or gets the notification
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+  }
+  // A parked worker would swallow a single notification
+  if (reserved_threads_ > 0)
+    condition_.notify_all();
+  else
+    condition_.notify_one();
+}
+
+EncoderPool::QueuePtr EncoderPool::take(std::size_t worker_index)
+{
+  // A low priority queue is only taken when no worker has anything more important waiting, so important streams
+  // keep their frame rate when the CPU runs out
+  for (int priority = PRIORITY_COUNT - 1; priority >= 0; --priority)
+  {
+    for (std::size_t i = 0; i < workers_.size(); ++i)
+    {
+      Worker &worker = *workers_[(worker_index + i) % workers_.size()];
+      boost::mutex::scoped_lock lock(worker.mutex);
+      std::deque<QueuePtr> &ready_queues = worker.ready_queues[priority];
+      if (ready_queues.empty())
+        continue;
+      QueuePtr queue;
+      if (i == 0)
+      {
+        queue = ready_queues.front();
+        ready_queues.pop_front();
+      }
+      else
+      {
+        queue = ready_queues.back();
+        ready_queues.pop_back();
+      }
+      --ready_count_;
+      return queue;
+    }
+  }
+  return QueuePtr();
+}
+
+void EncoderPool::run(std::size_t worker_index)
+{
+  while (true)
+  {
+    // Queues in the deques of parked workers are stolen by the others
+    QueuePtr queue = isParked(worker_index) ? QueuePtr() : take(worker_index);
+    if (!queue)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      // The count can be briefly negative while a queue is taken before schedule has counted it
+      while (!stopped_ && (ready_count_ <= 0 || isParked(worker_index)))
+        condition_.wait(lock);
+      if (stopped_)
+        return;
+      continue;
+    }
+    // Queues with more work go to the back of this worker's deque, so a busy stream does not keep the others of its
+    // priority waiting. A job is never interrupted, a more important stream gets the next free worker.
+    if (queue->runNext())
+      schedule(queue, worker_index);
+  }
+}
+
+}
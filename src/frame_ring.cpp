@@ -0,0 +1,118 @@
+#include "web_video_server/frame_ring.h"
+#include <algorithm>
+
+namespace web_video_server
+{
+
+FrameRing::FrameRing(std::size_t capacity) :
+    slots_(std::max(capacity, (std::size_t)1)), head_(0)
+{
+}
+
+void FrameRing::publish(FrameBufferPtr data, const ros::Time &stamp, bool key_frame)
+{
+  store(data, stamp, key_frame);
+  notifyListeners();
+}
+
+uint64_t FrameRing::store(FrameBufferPtr data, const ros::Time &stamp, bool key_frame)
+{
+  boost::mutex::scoped_lock lock(publish_mutex_);
+  boost::shared_ptr<Frame> frame(new Frame());
+  frame->data = data;
+  frame->stamp = stamp;
+  frame->key_frame = key_frame;
+  frame->sequence = head_.load(boost::memory_order_relaxed) + 1;
+  boost::atomic_store(&slots_[frame->sequence % slots_.size()], FramePtr(frame));
+  // Readers only look at slots up to the head, so the frame has to be in place before the head moves on
+  head_.store(frame->sequence, boost::memory_order_release);
+  return frame->sequence;
+}
+
+void FrameRing::notifyListeners()
+{
+  std::vector<std::pair<Listener, boost::weak_ptr<void> > > current_listeners;
+  {
+    boost::mutex::scoped_lock lock(listeners_mutex_);
+    current_listeners = listeners_;
+  }
+  for (std::vector<std::pair<Listener, boost::weak_ptr<void> > >::iterator itr = current_listeners.begin();
+      itr != current_listeners.end(); ++itr)
+  {
+    boost::shared_ptr<void> tracked_object = itr->second.lock();
+    if (tracked_object)
+      itr->first();
+  }
+}
+
+uint64_t FrameRing::getHead() const
+{
+  return head_.load(boost::memory_order_acquire);
+}
+
+FrameRing::FramePtr FrameRing::getFrame(uint64_t sequence) const
+{
+  if (sequence == 0 || sequence > getHead())
+    return FramePtr();
+  FramePtr frame = boost::atomic_load(&slots_[sequence % slots_.size()]);
+  // The slot holds a newer frame once the producer has gone all the way around the ring
+  if (!frame || frame->sequence != sequence)
+    return FramePtr();
+  return frame;
+}
+
+FrameRing::FramePtr FrameRing::getLatestKeyFrame(uint64_t cursor) const
+{
+  uint64_t head = getHead();
+  uint64_t oldest = head >= slots_.size() ? head - slots_.size() + 1 : 1;
+  for (uint64_t sequence = head; sequence > cursor && sequence >= oldest; --sequence)
+  {
+    FramePtr frame = getFrame(sequence);
+    if (frame && frame->key_frame)
+      return frame;
+  }
+  return FramePtr();
+}
+
+FrameRing::FramePtr FrameRing::getLatestUntil(uint64_t cursor, const ros::Time &stamp) const
+{
+  uint64_t head = getHead();
+  uint64_t oldest = head >= slots_.size() ? head - slots_.size() + 1 : 1;
+  for (uint64_t sequence = head; sequence > cursor && sequence >= oldest; --sequence)
+  {
+    FramePtr frame = getFrame(sequence);
+    if (frame && frame->stamp <= stamp)
+      return frame;
+  }
+  return FramePtr();
+}
+
+void FrameRing::addListener(const Listener &listener, const boost::weak_ptr<void> &tracked_object)
+{
+  boost::mutex::scoped_lock lock(listeners_mutex_);
+  std::vector<std::pair<Listener, boost::weak_ptr<void> > >::iterator itr = listeners_.begin();
+  while (itr != listeners_.end())
+  {
+    if (itr->second.expired())
+      itr = listeners_.erase(itr);
+    else
+      ++itr;
+  }
+  listeners_.push_back(std::make_pair(listener, tracked_object));
+}
+
+void FrameRing::removeListener(const boost::weak_ptr<void> &tracked_object)
+{
+  boost::mutex::scoped_lock lock(listeners_mutex_);
+  std::vector<std::pair<Listener, boost::weak_ptr<void> > >::iterator itr = listeners_.begin();
+  while (itr != listeners_.end())
+  {
+    bool same_object = !itr->second.owner_before(tracked_object) && !tracked_object.owner_before(itr->second);
+    if (same_object || itr->second.expired())
+      itr = listeners_.erase(itr);
+    else
+      ++itr;
+  }
+}
+
+}
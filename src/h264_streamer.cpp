@@ -0,0 +1,66 @@
+#include "web_video_server/h264_streamer.h"
+
+namespace web_video_server
+{
+
+H264Streamer::H264Streamer(const async_web_server_cpp::HttpRequest& request,
+                           async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                           boost::shared_ptr<ImageTopicHub> topic_hub) :
+    LibavStreamer(request, connection, nh, topic_hub, "mp4", "libx264", "video/mp4")
+{
+  preset_ = request.get_query_param_value_or_default("preset", "ultrafast");
+  tune_ = request.get_query_param_value_or_default("tune", "zerolatency");
+  // Constant quality instead of the bitrate if given, lower is better
+  crf_ = request.get_query_param_value_or_default<int>("crf", -1);
+  last_frame_pts_ = -1;
+  flush_every_frame_ = true;
+}
+H264Streamer::~H264Streamer()
+{
+}
+
+void H264Streamer::initializeEncoder()
+{
+  av_opt_set(codec_context_->priv_data, "preset", preset_.c_str(), 0);
+  av_opt_set(codec_context_->priv_data, "tune", tune_.c_str(), 0);
+  if (crf_ >= 0)
+  {
+    // libx264 only uses crf without a bitrate
+    codec_context_->bit_rate = 0;
+    av_opt_set_int(codec_context_->priv_data, "crf", crf_, 0);
+  }
+
+  // Frames are timestamped in milliseconds, see getFramePts
+  codec_context_->time_base.num = 1;
+  codec_context_->time_base.den = 1000;
+}
+
+void H264Streamer::initializeMuxer(AVDictionary **options)
+{
+  // Send an empty moov up front, then a self contained moof/mdat fragment for every frame
+  av_dict_set(options, "movflags", "empty_moov+default_base_moof+frag_custom", 0);
+}
+
+int64_t H264Streamer::getFramePts(double seconds_since_first_frame)
+{
+  // x264 expects strictly increasing timestamps
+  int64_t pts = (int64_t)(seconds_since_first_frame * 1000);
+  if (pts <= last_frame_pts_)
+    pts = last_frame_pts_ + 1;
+  last_frame_pts_ = pts;
+  return pts;
+}
+
+H264StreamerType::H264StreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, int encoder_threads) :
+    LibavStreamerType(topic_hub, "mp4", "libx264", "video/mp4", encoder_threads)
+{
+}
+
+boost::shared_ptr<LibavStreamer> H264StreamerType::create_libav_streamer(
+    const async_web_server_cpp::HttpRequest& request, async_web_server_cpp::HttpConnectionPtr connection,
+    ros::NodeHandle& nh)
+{
+  return boost::shared_ptr<LibavStreamer>(new H264Streamer(request, connection, nh, topic_hub_));
+}
+
+}
@@ -1,19 +1,53 @@
 #include "web_video_server/image_streamer.h"
 #include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
 
 namespace web_video_server
 {
 
 ImageStreamer::ImageStreamer(const async_web_server_cpp::HttpRequest &request,
-                             async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh) :
-    request_(request), connection_(connection), nh_(nh), inactive_(false)
+                             async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                             boost::shared_ptr<ImageTopicHub> topic_hub) :
+    request_(request), connection_(connection), nh_(nh), topic_hub_(topic_hub), inactive_(false)
 {
   topic_ = request.get_query_param_value_or_default("topic", "");
+  // The server's max_fps parameter is applied by setDefaultMaxFps when the request does not give one
+  max_fps_ = request.get_query_param_value_or_default<double>("max_fps", 0);
+  // Operator views ask for high priority, recorders and thumbnails for low priority
+  priority_ = EncoderPool::parsePriority(request.get_query_param_value_or_default("priority", ""),
+                                         EncoderPool::NORMAL_PRIORITY);
+}
+
+void ImageStreamer::setDefaultMaxFps(double max_fps)
+{
+  if (!request_.has_query_param("max_fps"))
+    max_fps_ = max_fps;
+}
+
+bool ImageStreamer::acceptFrame()
+{
+  if (max_fps_ <= 0)
+    return true;
+
+  ros::WallTime now = ros::WallTime::now();
+  ros::WallDuration period(1.0 / max_fps_);
+  // Frames arriving slightly early are still taken, otherwise jitter would halve the rate when the source runs at
+  // exactly max_fps
+  if (now < next_frame_time_ - period * 0.1)
+    return false;
+
+  // Follow the schedule to keep the average rate, unless the source fell behind it
+  if (now - next_frame_time_ > period)
+    next_frame_time_ = now + period;
+  else
+    next_frame_time_ += period;
+  return true;
 }
 
 ImageTransportImageStreamer::ImageTransportImageStreamer(const async_web_server_cpp::HttpRequest &request,
-                             async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh) :
-  ImageStreamer(request, connection, nh), it_(nh), initialized_(false)
+                             async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                             boost::shared_ptr<ImageTopicHub> topic_hub) :
+  ImageStreamer(request, connection, nh, topic_hub), initialized_(false)
 {
   output_width_ = request.get_query_param_value_or_default<int>("width", -1);
   output_height_ = request.get_query_param_value_or_default<int>("height", -1);
@@ -23,109 +57,216 @@ ImageTransportImageStreamer::ImageTransportImageStreamer(const async_web_server_
 
 void ImageTransportImageStreamer::start()
 {
-  image_transport::TransportHints hints(default_transport_);
-  image_sub_ = it_.subscribe(topic_, 1, &ImageTransportImageStreamer::imageCallback, this, hints);
+#ifdef HAVE_TURBOJPEG
+  // Decode JPEGs here rather than in the image_transport plugin, so they can be scaled down while decoding
+  if (default_transport_ == "compressed")
+  {
+    queue_ = topic_hub_->subscribeCompressed(
+        topic_, boost::bind(&ImageTransportImageStreamer::compressedImageCallback, this, _1), shared_from_this(),
+        priority_);
+    return;
+  }
+#endif
+  queue_ = topic_hub_->subscribe(topic_, default_transport_,
+                                 boost::bind(&ImageTransportImageStreamer::imageCallback, this, _1), shared_from_this(),
+                                 priority_);
+}
+
+void ImageTransportImageStreamer::initialize()
+{
+}
+
+bool ImageTransportImageStreamer::sendRawImage(const sensor_msgs::ImageConstPtr &)
+{
+  return false;
 }
 
-void ImageTransportImageStreamer::initialize(const cv::Mat &)
+bool ImageTransportImageStreamer::isFrameEncoded(const ros::Time &)
 {
+  return false;
+}
+
+void ImageTransportImageStreamer::prepareOutput(int input_width, int input_height)
+{
+  if (output_width_ == -1)
+    output_width_ = input_width;
+  if (output_height_ == -1)
+    output_height_ = input_height;
+
+  if (!initialized_)
+  {
+    initialize();
+    initialized_ = true;
+  }
 }
 
 void ImageTransportImageStreamer::imageCallback(const sensor_msgs::ImageConstPtr &msg)
 {
-  if (inactive_)
+  if (inactive_ || !acceptFrame() || isFrameEncoded(msg->header.stamp))
     return;
 
   cv::Mat img;
+  // rgb8 images are inverted and resized as they are, and only swapped to BGR at the output size
+  bool swap_rgb = false;
   try
   {
+    prepareOutput(msg->width, msg->height);
+
+    if (!invert_ && sendRawImage(msg))
+      return;
+
     if (msg->encoding.find("F") != std::string::npos)
     {
       // scale floating point images
-      cv::Mat float_image_bridge = cv_bridge::toCvCopy(msg, msg->encoding)->image;
-      cv::Mat_<float> float_image = float_image_bridge;
+      cv::Mat float_image = cv_bridge::toCvShare(msg, msg->encoding)->image;
       double max_val;
       cv::minMaxIdx(float_image, 0, &max_val);
 
+      double scale = 1;
       if (max_val > 0)
       {
-        float_image *= (255 / max_val);
+        scale = 255 / max_val;
       }
-      img = float_image;
+      float_image.convertTo(img, CV_8U, scale);
+    }
+    else if (sensor_msgs::image_encodings::isMono(msg->encoding))
+    {
+      // Keep grayscale images single channel, encoders handle them directly
+      img = cv_bridge::toCvShare(msg, "mono8")->image;
+    }
+    else if (msg->encoding == sensor_msgs::image_encodings::RGB8)
+    {
+      img = cv_bridge::toCvShare(msg)->image;
+      swap_rgb = true;
     }
     else
     {
-      // Convert to OpenCV native BGR color
-      img = cv_bridge::toCvCopy(msg, "bgr8")->image;
+      // Convert to OpenCV native BGR color, this only copies if the image is not bgr8 already
+      img = cv_bridge::toCvShare(msg, "bgr8")->image;
     }
 
-    int input_width = img.cols;
-    int input_height = img.rows;
+    processImage(img, swap_rgb, msg->header.stamp);
+  }
+  catch (...)
+  {
+    handleException();
+  }
+}
 
-    if (output_width_ == -1)
-      output_width_ = input_width;
-    if (output_height_ == -1)
-      output_height_ = input_height;
+void ImageTransportImageStreamer::compressedImageCallback(const sensor_msgs::CompressedImageConstPtr &msg)
+{
+  if (inactive_ || !acceptFrame() || isFrameEncoded(msg->header.stamp))
+    return;
 
-    if (invert_)
-    {
-      // Rotate 180 degrees
-      cv::flip(img, img, false);
-      cv::flip(img, img, true);
-    }
+  try
+  {
+    cv::Mat img;
+#ifdef HAVE_TURBOJPEG
+    if (!jpeg_decoder_)
+      jpeg_decoder_.reset(new JpegDecoder());
 
-    cv::Mat output_size_image;
-    if (output_width_ != input_width || output_height_ != input_height)
+    int width, height;
+    if (!msg->data.empty() && jpeg_decoder_->readHeader(&msg->data[0], msg->data.size(), width, height))
     {
-      cv::Mat img_resized;
-      cv::Size new_size(output_width_, output_height_);
-      cv::resize(img, img_resized, new_size);
-      output_size_image = img_resized;
+      prepareOutput(width, height);
+      jpeg_decoder_->decode(&msg->data[0], msg->data.size(), output_width_, output_height_, img);
     }
     else
+#endif
     {
-      output_size_image = img;
+      // Other formats such as png, and without libturbojpeg all of them, are decoded at full size
+      img = cv::imdecode(msg->data, CV_LOAD_IMAGE_ANYCOLOR);
+      if (img.empty())
+        throw std::runtime_error("Could not decode compressed image");
+      prepareOutput(img.cols, img.rows);
     }
 
-    if (!initialized_)
-    {
-      initialize(output_size_image);
-      initialized_ = true;
-    }
-    sendImage(output_size_image, msg->header.stamp);
+    processImage(img, false, msg->header.stamp);
+  }
+  catch (...)
+  {
+    handleException();
+  }
+}
 
+void ImageTransportImageStreamer::handleException()
+{
+  // Rethrows the exception being handled to tell the kinds apart, every one of them ends the stream
+  inactive_ = true;
+  try
+  {
+    throw;
   }
   catch (cv_bridge::Exception &e)
   {
     ROS_ERROR_THROTTLE(30, "cv_bridge exception: %s", e.what());
-    inactive_ = true;
-    return;
   }
   catch (cv::Exception &e)
   {
-    ROS_ERROR_THROTTLE(30, "cv_bridge exception: %s", e.what());
-    inactive_ = true;
-    return;
+    ROS_ERROR_THROTTLE(30, "cv exception: %s", e.what());
   }
   catch (boost::system::system_error &e)
   {
     // happens when client disconnects
     ROS_DEBUG("system_error exception: %s", e.what());
-    inactive_ = true;
-    return;
   }
   catch (std::exception &e)
   {
     ROS_ERROR_THROTTLE(30, "exception: %s", e.what());
-    inactive_ = true;
-    return;
   }
   catch (...)
   {
     ROS_ERROR_THROTTLE(30, "exception");
-    inactive_ = true;
-    return;
   }
 }
 
+void ImageTransportImageStreamer::processImage(const cv::Mat &img, bool swap_rgb, const ros::Time &time)
+{
+  // img may point straight into a message buffer, so every step below writes its result into a new image instead
+  // of modifying img in place
+  int input_width = img.cols;
+  int input_height = img.rows;
+
+  bool resize = output_width_ != input_width || output_height_ != input_height;
+
+  cv::Mat output_size_image;
+  if (invert_ && resize)
+  {
+    // Resize first, so only the smaller output image is rotated
+    cv::Size new_size(output_width_, output_height_);
+    cv::resize(img, output_size_image, new_size);
+    cv::flip(output_size_image, output_size_image, -1);
+  }
+  else if (invert_)
+  {
+    // Rotate 180 degrees
+    cv::flip(img, output_size_image, -1);
+  }
+  else if (resize)
+  {
+    cv::Size new_size(output_width_, output_height_);
+    cv::resize(img, output_size_image, new_size);
+  }
+  else
+  {
+    output_size_image = img;
+  }
+
+  if (swap_rgb)
+  {
+    if (output_size_image.data == img.data)
+    {
+      cv::Mat img_bgr;
+      cv::cvtColor(img, img_bgr, CV_RGB2BGR);
+      output_size_image = img_bgr;
+    }
+    else
+    {
+      cv::cvtColor(output_size_image, output_size_image, CV_RGB2BGR);
+    }
+  }
+
+  sendImage(output_size_image, time);
+}
+
 }
@@ -0,0 +1,153 @@
+#include "web_video_server/image_topic_hub.h"
+
+namespace web_video_server
+{
+
+template<class M, class S>
+  void ImageTopicHub::Topic<M, S>::addListener(const Callback &callback, const boost::weak_ptr<void> &tracked_object,
+                                               const EncoderPool::QueuePtr &queue)
+  {
+    Listener listener;
+    listener.callback = callback;
+    listener.tracked_object = tracked_object;
+    listener.queue = queue;
+    boost::mutex::scoped_lock lock(mutex);
+    listeners.push_back(listener);
+  }
+
+template<class M, class S>
+  void ImageTopicHub::Topic<M, S>::dispatch(const MessageConstPtr &msg)
+  {
+    std::vector<Listener> current_listeners;
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      current_listeners = listeners;
+      latest = msg;
+      latest_receipt_time = ros::WallTime::now();
+    }
+    // Only hand the message over, converting and encoding happens on the encoder pool so the ROS callback threads
+    // stay free for other topics
+    for (typename std::vector<Listener>::iterator itr = current_listeners.begin(); itr != current_listeners.end();
+        ++itr)
+    {
+      if (!itr->tracked_object.expired())
+        itr->queue->post(boost::bind(itr->callback, msg));
+    }
+  }
+
+template<class M, class S>
+  bool ImageTopicHub::Topic<M, S>::hasListeners()
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    typename std::vector<Listener>::iterator itr = listeners.begin();
+    while (itr != listeners.end())
+    {
+      if (itr->tracked_object.expired())
+        itr = listeners.erase(itr);
+      else
+        ++itr;
+    }
+    return !listeners.empty();
+  }
+
+ImageTopicHub::ImageTopicHub(ros::NodeHandle &nh, boost::shared_ptr<EncoderPool> encoder_pool) :
+    nh_(nh), it_(nh), encoder_pool_(encoder_pool)
+{
+}
+
+EncoderPool::QueuePtr ImageTopicHub::subscribe(const std::string &topic, const std::string &transport,
+                                               const ImageCallback &callback,
+                                               const boost::weak_ptr<void> &tracked_object,
+                                               EncoderPool::Priority priority)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  boost::shared_ptr<ImageTopic> &image_topic = image_topics_[transport + ":" + topic];
+  if (!image_topic)
+  {
+    image_topic.reset(new ImageTopic());
+    image_transport::TransportHints hints(transport);
+    image_topic->subscriber = it_.subscribe(topic, 1, boost::bind(&ImageTopic::dispatch, image_topic.get(), _1),
+                                            image_topic, hints);
+  }
+  EncoderPool::QueuePtr queue = encoder_pool_->createQueue(tracked_object, priority);
+  image_topic->addListener(callback, tracked_object, queue);
+  return queue;
+}
+
+EncoderPool::QueuePtr ImageTopicHub::subscribeCompressed(const std::string &topic,
+                                                         const CompressedImageCallback &callback,
+                                                         const boost::weak_ptr<void> &tracked_object,
+                                                         EncoderPool::Priority priority)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  boost::shared_ptr<CompressedImageTopic> &compressed_topic = compressed_topics_[topic];
+  if (!compressed_topic)
+  {
+    compressed_topic.reset(new CompressedImageTopic());
+    compressed_topic->subscriber = nh_.subscribe<sensor_msgs::CompressedImage>(
+        topic + "/compressed", 1, boost::bind(&CompressedImageTopic::dispatch, compressed_topic.get(), _1),
+        compressed_topic);
+  }
+  EncoderPool::QueuePtr queue = encoder_pool_->createQueue(tracked_object, priority);
+  compressed_topic->addListener(callback, tracked_object, queue);
+  return queue;
+}
+
+EncoderPool::QueuePtr ImageTopicHub::createQueue(const boost::weak_ptr<void> &tracked_object,
+                                                 EncoderPool::Priority priority)
+{
+  return encoder_pool_->createQueue(tracked_object, priority);
+}
+
+template<class M, class S>
+  typename ImageTopicHub::Topic<M, S>::MessageConstPtr ImageTopicHub::Topic<M, S>::getLatest(double max_age)
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    if (max_age >= 0 && (ros::WallTime::now() - latest_receipt_time).toSec() > max_age)
+      return MessageConstPtr();
+    return latest;
+  }
+
+sensor_msgs::ImageConstPtr ImageTopicHub::getLatestImage(const std::string &topic, const std::string &transport,
+                                                         double max_age)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  std::map<std::string, boost::shared_ptr<ImageTopic> >::iterator itr = image_topics_.find(transport + ":" + topic);
+  if (itr == image_topics_.end())
+    return sensor_msgs::ImageConstPtr();
+  return itr->second->getLatest(max_age);
+}
+
+sensor_msgs::CompressedImageConstPtr ImageTopicHub::getLatestCompressedImage(const std::string &topic, double max_age)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  std::map<std::string, boost::shared_ptr<CompressedImageTopic> >::iterator itr = compressed_topics_.find(topic);
+  if (itr == compressed_topics_.end())
+    return sensor_msgs::CompressedImageConstPtr();
+  return itr->second->getLatest(max_age);
+}
+
+template<class T>
+  void ImageTopicHub::removeUnused(std::map<std::string, boost::shared_ptr<T> > &topics)
+  {
+    typename std::map<std::string, boost::shared_ptr<T> >::iterator itr = topics.begin();
+    while (itr != topics.end())
+    {
+      if (!itr->second->hasListeners())
+      {
+        itr->second->subscriber.shutdown();
+        topics.erase(itr++);
+      }
+      else
+        ++itr;
+    }
+  }
+
+void ImageTopicHub::cleanup()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  removeUnused(image_topics_);
+  removeUnused(compressed_topics_);
+}
+
+}
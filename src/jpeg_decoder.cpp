@@ -0,0 +1,67 @@
+#include "web_video_server/jpeg_decoder.h"
+
+#ifdef HAVE_TURBOJPEG
+
+namespace web_video_server
+{
+
+JpegDecoder::JpegDecoder() :
+    handle_(tjInitDecompress())
+{
+  if (!handle_)
+    throw std::runtime_error(tjGetErrorStr());
+}
+
+JpegDecoder::~JpegDecoder()
+{
+  tjDestroy(handle_);
+}
+
+bool JpegDecoder::readHeader(const unsigned char *data, unsigned long size, int &width, int &height)
+{
+  int subsampling;
+  return tjDecompressHeader2(handle_, const_cast<unsigned char *>(data), size, &width, &height, &subsampling) == 0;
+}
+
+void JpegDecoder::decode(const unsigned char *data, unsigned long size, int min_width, int min_height,
+                         cv::Mat &image)
+{
+  int width, height, subsampling;
+  if (tjDecompressHeader2(handle_, const_cast<unsigned char *>(data), size, &width, &height, &subsampling) != 0)
+    throw std::runtime_error(tjGetErrorStr());
+
+  // Scaling is done on the DCT coefficients, so smaller factors skip most of the decoding work
+  int num_factors;
+  tjscalingfactor *factors = tjGetScalingFactors(&num_factors);
+  int scaled_width = width;
+  int scaled_height = height;
+  for (int i = 0; factors && i < num_factors; ++i)
+  {
+    int factor_width = TJSCALED(width, factors[i]);
+    int factor_height = TJSCALED(height, factors[i]);
+    if (factor_width >= min_width && factor_height >= min_height && factor_width <= scaled_width
+        && factor_height <= scaled_height)
+    {
+      scaled_width = factor_width;
+      scaled_height = factor_height;
+    }
+  }
+
+  int pixel_format = TJPF_BGR;
+  int type = CV_8UC3;
+  if (subsampling == TJSAMP_GRAY)
+  {
+    pixel_format = TJPF_GRAY;
+    type = CV_8UC1;
+  }
+  image.create(scaled_height, scaled_width, type);
+  if (tjDecompress2(handle_, const_cast<unsigned char *>(data), size, image.data, scaled_width, image.step,
+                    scaled_height, pixel_format, 0) != 0)
+  {
+    throw std::runtime_error(tjGetErrorStr());
+  }
+}
+
+}
+
+#endif
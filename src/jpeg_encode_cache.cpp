@@ -0,0 +1,86 @@
+#include "web_video_server/jpeg_encode_cache.h"
+#include <boost/tuple/tuple_comparison.hpp>
+
+namespace web_video_server
+{
+
+// Readers of JPEG streams only ever take the newest frame, the older slots just cover frames still being written
+static const std::size_t ring_capacity = 4;
+
+JpegEncodeCache::Entry::Entry(int quality, boost::shared_ptr<JpegEncoder> encoder,
+                              boost::shared_ptr<BufferPool> buffer_pool) :
+    quality_(quality), encoder_(encoder), buffer_pool_(buffer_pool), ring_(new FrameRing(ring_capacity))
+{
+}
+
+FrameBufferPtr JpegEncodeCache::Entry::encode(const cv::Mat &img, const ros::Time &time)
+{
+  BufferPool::BufferPtr encoded_buffer;
+  {
+    // Hold the lock while encoding so streamers receiving the same frame wait for the first encode instead of
+    // duplicating it
+    boost::mutex::scoped_lock lock(mutex_);
+    // Publishers that do not stamp their images can not be told apart, so never share their frames
+    if (last_frame_ && !time.isZero() && time == last_time_)
+      return last_frame_;
+
+    encoded_buffer = buffer_pool_->acquire();
+    encoder_->encode(img, quality_, *encoded_buffer);
+
+    // Frames arriving out of order are only returned to the caller
+    if (time < last_time_)
+      return encoded_buffer;
+    last_time_ = time;
+    last_frame_ = encoded_buffer;
+    // Stored under the lock so the ring keeps the order of the stamps
+    ring_->store(encoded_buffer, time, true);
+  }
+  // Readers write to their connections and may switch entries when polled, so the next encode must not wait for them
+  ring_->notifyListeners();
+  return encoded_buffer;
+}
+
+FrameBufferPtr JpegEncodeCache::Entry::getFrame(const ros::Time &time)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if (last_frame_ && !time.isZero() && time == last_time_)
+    return last_frame_;
+  return FrameBufferPtr();
+}
+
+boost::shared_ptr<FrameRing> JpegEncodeCache::Entry::getRing()
+{
+  return ring_;
+}
+
+JpegEncodeCache::JpegEncodeCache(boost::shared_ptr<JpegEncoder> encoder) :
+    encoder_(encoder), buffer_pool_(new BufferPool(32))
+{
+}
+
+JpegEncodeCache::EntryPtr JpegEncodeCache::getEntry(const std::string &topic, int width, int height, int quality,
+                                                    bool invert)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // Drop entries whose streamers have all gone away
+  std::map<Key, boost::weak_ptr<Entry> >::iterator itr = entries_.begin();
+  while (itr != entries_.end())
+  {
+    if (itr->second.expired())
+      entries_.erase(itr++);
+    else
+      ++itr;
+  }
+
+  Key key(topic, width, height, quality, invert);
+  EntryPtr entry = entries_[key].lock();
+  if (!entry)
+  {
+    entry.reset(new Entry(quality, encoder_, buffer_pool_));
+    entries_[key] = entry;
+  }
+  return entry;
+}
+
+}
@@ -0,0 +1,126 @@
+#include "web_video_server/jpeg_encoder.h"
+
+namespace web_video_server
+{
+
+boost::shared_ptr<JpegEncoder> JpegEncoder::create(ros::NodeHandle &private_nh)
+{
+  std::string encoder;
+  private_nh.param<std::string>("jpeg_encoder", encoder, "opencv");
+
+  if (encoder == "turbojpeg")
+  {
+#ifdef HAVE_TURBOJPEG
+    std::string subsampling;
+    bool fast_dct;
+    private_nh.param<std::string>("jpeg_subsampling", subsampling, "420");
+    private_nh.param("jpeg_fast_dct", fast_dct, false);
+
+    int tj_subsampling = TJSAMP_420;
+    if (subsampling == "444")
+      tj_subsampling = TJSAMP_444;
+    else if (subsampling == "422")
+      tj_subsampling = TJSAMP_422;
+    else if (subsampling != "420")
+      ROS_WARN_STREAM("Unknown jpeg_subsampling '" << subsampling << "', using 420");
+
+    return boost::shared_ptr<JpegEncoder>(new TurboJpegEncoder(tj_subsampling, fast_dct));
+#else
+    ROS_WARN("web_video_server was built without libturbojpeg, using the OpenCV JPEG encoder");
+#endif
+  }
+  else if (encoder != "opencv")
+  {
+    ROS_WARN_STREAM("Unknown jpeg_encoder '" << encoder << "', using the OpenCV JPEG encoder");
+  }
+  return boost::shared_ptr<JpegEncoder>(new OpenCvJpegEncoder());
+}
+
+void OpenCvJpegEncoder::encode(const cv::Mat &img, int quality, std::vector<unsigned char> &buffer)
+{
+  std::vector<int> encode_params;
+  encode_params.push_back(CV_IMWRITE_JPEG_QUALITY);
+  encode_params.push_back(quality);
+
+  cv::imencode(".jpeg", img, buffer, encode_params);
+}
+
+#ifdef HAVE_TURBOJPEG
+TurboJpegEncoder::ThreadState::ThreadState() :
+    handle(tjInitCompress()), buffer(NULL), buffer_size(0)
+{
+}
+
+TurboJpegEncoder::ThreadState::~ThreadState()
+{
+  if (buffer)
+    tjFree(buffer);
+  if (handle)
+    tjDestroy(handle);
+}
+
+TurboJpegEncoder::TurboJpegEncoder(int subsampling, bool fast_dct) :
+    subsampling_(subsampling), flags_(TJFLAG_NOREALLOC)
+{
+  if (fast_dct)
+    flags_ |= TJFLAG_FASTDCT;
+}
+
+void TurboJpegEncoder::encode(const cv::Mat &img, int quality, std::vector<unsigned char> &buffer)
+{
+  cv::Mat img_8u = img;
+  if (img.depth() != CV_8U)
+    img.convertTo(img_8u, CV_8U);
+
+  int pixel_format;
+  int subsampling = subsampling_;
+  switch (img_8u.channels())
+  {
+    case 1:
+      pixel_format = TJPF_GRAY;
+      subsampling = TJSAMP_GRAY;
+      break;
+    case 3:
+      pixel_format = TJPF_BGR;
+      break;
+    case 4:
+      pixel_format = TJPF_BGRA;
+      break;
+    default:
+      throw std::runtime_error("Unsupported number of channels for JPEG encoding");
+  }
+
+  ThreadState *state = thread_state_.get();
+  if (!state)
+  {
+    state = new ThreadState();
+    thread_state_.reset(state);
+  }
+  if (!state->handle)
+    throw std::runtime_error(tjGetErrorStr());
+
+  // Size the output buffer for the worst case so the compressor never has to grow it
+  unsigned long max_size = tjBufSize(img_8u.cols, img_8u.rows, subsampling);
+  if (state->buffer_size < max_size)
+  {
+    if (state->buffer)
+      tjFree(state->buffer);
+    state->buffer = tjAlloc(max_size);
+    state->buffer_size = state->buffer ? max_size : 0;
+    if (!state->buffer)
+      throw std::runtime_error("Could not allocate JPEG buffer");
+  }
+
+  unsigned long jpeg_size = state->buffer_size;
+  if (tjCompress2(state->handle, img_8u.data, img_8u.cols, img_8u.step, img_8u.rows, pixel_format, &state->buffer,
+                  &jpeg_size, subsampling, quality, flags_) != 0)
+  {
+    throw std::runtime_error(tjGetErrorStr());
+  }
+  // Copying the JPEG out is cheaper than compressing into buffer, which would have to be resized (and zero-filled) to
+  // the worst case size first
+  buffer.assign(state->buffer, state->buffer + jpeg_size);
+}
+#endif
+
+}
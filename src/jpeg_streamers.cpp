@@ -4,31 +4,147 @@
 namespace web_video_server
 {
 
+// Quality changes in steps, so rate controlled streams at the same quality still share their encoded frames
+static const int quality_step = 5;
+static const int min_adaptive_quality = 10;
+
 MjpegStreamer::MjpegStreamer(const async_web_server_cpp::HttpRequest &request,
-                             async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh) :
-  ImageTransportImageStreamer(request, connection, nh), stream_(connection)
+                             async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                             boost::shared_ptr<ImageTopicHub> topic_hub,
+                             boost::shared_ptr<JpegEncodeCache> encode_cache) :
+  ImageTransportImageStreamer(request, connection, nh, topic_hub), stream_(connection), encode_cache_(encode_cache),
+  ring_cursor_(0), average_frame_size_(0), average_frame_interval_(0)
 {
   quality_ = request.get_query_param_value_or_default<int>("quality", 95);
+  // Target bitrate in bits per second, 0 keeps the quality fixed
+  bitrate_ = request.get_query_param_value_or_default<int>("bitrate", 0);
+  current_quality_ = quality_;
   stream_.sendInitialHeader();
 }
 
+void MjpegStreamer::initialize()
+{
+  boost::mutex::scoped_lock lock(ring_mutex_);
+  attachEntry();
+  // A client that just received everything takes the newest frame, instead of waiting for the next one
+  stream_.setReadyCallback(boost::bind(&MjpegStreamer::pollRing, this), shared_from_this());
+}
+
+void MjpegStreamer::attachEntry()
+{
+  // Called with ring_mutex_ held
+  if (ring_)
+    ring_->removeListener(shared_from_this());
+  encode_cache_entry_ = encode_cache_->getEntry(topic_, output_width_, output_height_, current_quality_, invert_);
+  ring_ = encode_cache_entry_->getRing();
+  // Frames already in the ring may be older than the last one sent from the previous entry
+  ring_cursor_ = ring_->getHead();
+  ring_->addListener(boost::bind(&MjpegStreamer::pollRing, this), shared_from_this());
+}
+
+bool MjpegStreamer::isFrameEncoded(const ros::Time &time)
+{
+  JpegEncodeCache::EntryPtr entry;
+  {
+    boost::mutex::scoped_lock lock(ring_mutex_);
+    if (bitrate_ > 0)
+    {
+      ros::WallTime now = ros::WallTime::now();
+      if (!last_frame_time_.isZero())
+      {
+        double interval = (now - last_frame_time_).toSec();
+        average_frame_interval_ = average_frame_interval_ > 0 ? 0.8 * average_frame_interval_ + 0.2 * interval :
+            interval;
+      }
+      last_frame_time_ = now;
+    }
+    // Only called for frames that passed acceptFrame, so this keeps the stream to its own max_fps
+    accepted_stamp_ = time;
+    entry = encode_cache_entry_;
+  }
+  // Another stream sharing the entry already encoded the frame, it reaches this stream through the ring
+  return entry && entry->getFrame(time);
+}
+
 void MjpegStreamer::sendImage(const cv::Mat &img, const ros::Time &time)
 {
-  std::vector<int> encode_params;
-  encode_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-  encode_params.push_back(quality_);
+  JpegEncodeCache::EntryPtr entry;
+  {
+    boost::mutex::scoped_lock lock(ring_mutex_);
+    entry = encode_cache_entry_;
+  }
+  // Publishing the frame polls every stream reading the ring, this one included
+  entry->encode(img, time);
+}
+
+void MjpegStreamer::pollRing()
+{
+  boost::mutex::scoped_lock lock(ring_mutex_);
+  if (inactive_ || !ring_)
+    return;
+
+  try
+  {
+    if (!stream_.isReady())
+      return;
+    // JPEG frames do not depend on each other, so a client that fell behind skips straight to the newest one it
+    // accepted
+    FrameRing::FramePtr frame = ring_->getLatestUntil(ring_cursor_, accepted_stamp_);
+    if (!frame)
+      return;
+    ring_cursor_ = frame->sequence;
+    stream_.sendPart(frame->stamp, "image/jpeg", frame->data);
+    if (bitrate_ > 0)
+      updateQuality(frame->data->size());
+  }
+  catch (boost::system::system_error &e)
+  {
+    // happens when client disconnects
+    ROS_DEBUG("system_error exception: %s", e.what());
+    inactive_ = true;
+  }
+}
+
+void MjpegStreamer::updateQuality(std::size_t frame_size)
+{
+  // Called with ring_mutex_ held
+  average_frame_size_ = average_frame_size_ > 0 ? 0.8 * average_frame_size_ + 0.2 * frame_size : frame_size;
+  if (average_frame_interval_ <= 0)
+    return;
+
+  // Aim for every frame to get through, at the requested bitrate or whatever less the connection has been taking
+  double budget = bitrate_ / 8.0;
+  double drain_rate = stream_.getDrainRate();
+  if (drain_rate > 0 && drain_rate < budget)
+    budget = drain_rate;
+  double target_frame_size = budget * average_frame_interval_;
 
-  std::vector<uchar> encoded_buffer;
-  cv::imencode(".jpeg", img, encoded_buffer, encode_params);
+  int quality = current_quality_;
+  if (average_frame_size_ > target_frame_size * 1.1)
+    quality = std::max(current_quality_ - quality_step, std::min(min_adaptive_quality, quality_));
+  else if (average_frame_size_ < target_frame_size * 0.8)
+    quality = std::min(current_quality_ + quality_step, quality_);
 
-  stream_.sendPartAndClear(time, "image/jpeg", encoded_buffer);
+  if (quality != current_quality_)
+  {
+    current_quality_ = quality;
+    attachEntry();
+  }
+}
+
+MjpegStreamerType::MjpegStreamerType(boost::shared_ptr<ImageTopicHub> topic_hub,
+                                     boost::shared_ptr<JpegEncodeCache> encode_cache) :
+    topic_hub_(topic_hub), encode_cache_(encode_cache)
+{
 }
 
 boost::shared_ptr<ImageStreamer> MjpegStreamerType::create_streamer(const async_web_server_cpp::HttpRequest &request,
                                                                     async_web_server_cpp::HttpConnectionPtr connection,
                                                                     ros::NodeHandle& nh)
 {
-  return boost::shared_ptr<ImageStreamer>(new MjpegStreamer(request, connection, nh));
+  boost::shared_ptr<ImageStreamer> streamer(new MjpegStreamer(request, connection, nh, topic_hub_, encode_cache_));
+  streamer->setDefaultMaxFps(default_max_fps_);
+  return streamer;
 }
 
 std::string MjpegStreamerType::create_viewer(const async_web_server_cpp::HttpRequest &request)
@@ -42,20 +158,48 @@ std::string MjpegStreamerType::create_viewer(const async_web_server_cpp::HttpReq
 
 JpegSnapshotStreamer::JpegSnapshotStreamer(const async_web_server_cpp::HttpRequest &request,
                                            async_web_server_cpp::HttpConnectionPtr connection,
-                                           ros::NodeHandle& nh) :
-    ImageTransportImageStreamer(request, connection, nh)
+                                           ros::NodeHandle& nh, boost::shared_ptr<ImageTopicHub> topic_hub,
+                                           boost::shared_ptr<JpegEncodeCache> encode_cache) :
+    ImageTransportImageStreamer(request, connection, nh, topic_hub), encode_cache_(encode_cache)
 {
   quality_ = request.get_query_param_value_or_default<int>("quality", 95);
+  // A cached image from a running stream is only used while it is recent, clients accept any age with a negative value
+  max_age_ = request.get_query_param_value_or_default<double>("max_age", 1.0);
+  // Someone is waiting for the answer, so snapshots go ahead of streams unless the request says otherwise
+  priority_ = EncoderPool::parsePriority(request.get_query_param_value_or_default("priority", ""),
+                                         EncoderPool::HIGH_PRIORITY);
 }
 
-void JpegSnapshotStreamer::sendImage(const cv::Mat &img, const ros::Time &time)
+void JpegSnapshotStreamer::start()
 {
-  std::vector<int> encode_params;
-  encode_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-  encode_params.push_back(quality_);
+  // Answer without waiting for the next message if the topic is already being streamed. The cached message is
+  // handled on the encoder pool like any other, so it never holds up the HTTP server thread.
+  sensor_msgs::ImageConstPtr latest = topic_hub_->getLatestImage(topic_, default_transport_, max_age_);
+  if (latest)
+  {
+    queue_ = topic_hub_->createQueue(shared_from_this(), priority_);
+    queue_->post(boost::bind(&JpegSnapshotStreamer::imageCallback, this, latest));
+    return;
+  }
+  // Streams passing the camera's JPEGs through or decoding them here only receive the compressed topic
+  sensor_msgs::CompressedImageConstPtr latest_compressed = topic_hub_->getLatestCompressedImage(topic_, max_age_);
+  if (latest_compressed)
+  {
+    queue_ = topic_hub_->createQueue(shared_from_this(), priority_);
+    queue_->post(boost::bind(&JpegSnapshotStreamer::compressedImageCallback, this, latest_compressed));
+    return;
+  }
+  ImageTransportImageStreamer::start();
+}
 
-  std::vector<uchar> encoded_buffer;
-  cv::imencode(".jpeg", img, encoded_buffer, encode_params);
+void JpegSnapshotStreamer::initialize()
+{
+  encode_cache_entry_ = encode_cache_->getEntry(topic_, output_width_, output_height_, quality_, invert_);
+}
+
+void JpegSnapshotStreamer::sendImage(const cv::Mat &img, const ros::Time &time)
+{
+  FrameBufferPtr encoded_buffer = encode_cache_entry_->encode(img, time);
 
   char stamp[20];
   sprintf(stamp, "%.06lf", time.toSec());
@@ -64,9 +208,9 @@ void JpegSnapshotStreamer::sendImage(const cv::Mat &img, const ros::Time &time)
                                            "no-cache, no-store, must-revalidate, pre-check=0, post-check=0, max-age=0").header(
       "X-Timestamp", stamp).header("Pragma", "no-cache").header("Content-type", "image/jpeg").header(
       "Access-Control-Allow-Origin", "*").header("Content-Length",
-                                                 boost::lexical_cast<std::string>(encoded_buffer.size())).write(
+                                                 boost::lexical_cast<std::string>(encoded_buffer->size())).write(
       connection_);
-  connection_->write_and_clear(encoded_buffer);
+  connection_->write(boost::asio::buffer(*encoded_buffer), encoded_buffer);
   inactive_ = true;
 }
 
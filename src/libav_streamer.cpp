@@ -1,9 +1,16 @@
 #include "web_video_server/libav_streamer.h"
 #include "async_web_server_cpp/http_reply.hpp"
+#include <sensor_msgs/image_encodings.h>
+#include <algorithm>
 
 namespace web_video_server
 {
 
+// Size of the staging buffer libavformat muxes into before handing data to writePacket
+static const int io_buffer_size = 32768;
+// Frames kept for clients reading behind the encoder, a client falling further behind skips to a keyframe
+static const std::size_t ring_capacity = 16;
+
 static int ffmpeg_boost_mutex_lock_manager(void **mutex, enum AVLockOp op)
 {
   if (NULL == mutex)
@@ -46,24 +53,54 @@ static int ffmpeg_boost_mutex_lock_manager(void **mutex, enum AVLockOp op)
 
 LibavStreamer::LibavStreamer(const async_web_server_cpp::HttpRequest &request,
                              async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
-                             const std::string &format_name, const std::string &codec_name,
-                             const std::string &content_type) :
-    ImageTransportImageStreamer(request, connection, nh), output_format_(0), format_context_(0), codec_(0), codec_context_(0), video_stream_(
-        0), frame_(0), picture_(0), tmp_picture_(0), sws_context_(0), first_image_timestamp_(0), format_name_(
-        format_name), codec_name_(codec_name), content_type_(content_type)
+                             boost::shared_ptr<ImageTopicHub> topic_hub, const std::string &format_name,
+                             const std::string &codec_name, const std::string &content_type) :
+    ImageTransportImageStreamer(request, connection, nh, topic_hub), output_format_(0), format_context_(0), codec_(0), codec_context_(0), video_stream_(
+        0), flush_every_frame_(false), ring_(new FrameRing(ring_capacity)), force_keyframe_(false), subscribed_(false), frame_(0), picture_(0), tmp_picture_(0), sws_context_(0),
+        first_image_timestamp_(0), last_packet_pts_(0), reserved_threads_(0), format_name_(format_name), codec_name_(codec_name),
+        content_type_(content_type), buffer_pool_(new BufferPool(ring_capacity + 4))
 {
 
   bitrate_ = request.get_query_param_value_or_default<int>("bitrate", 100000);
   qmin_ = request.get_query_param_value_or_default<int>("qmin", 10);
   qmax_ = request.get_query_param_value_or_default<int>("qmax", 42);
   gop_ = request.get_query_param_value_or_default<int>("gop", 250);
+  // The matroska muxer holds frames back until it closes a cluster. Closing it after every frame sends frames right
+  // away and gives each keyframe a cluster of its own, which clients joining a shared stream start at.
+  flush_every_frame_ = format_name_ == "webm";
+
+  SinkPtr sink(new Sink());
+  sink->connection = connection;
+  sink->throttled_connection.reset(new ThrottledConnection(connection));
+  sink->cursor = 0;
+  sink->waiting_for_keyframe = false;
+  sink->priority = priority_;
+  sinks_.push_back(sink);
 
   av_lockmgr_register(&ffmpeg_boost_mutex_lock_manager);
   av_register_all();
 }
 
+boost::mutex LibavStreamer::thread_budget_mutex_;
+int LibavStreamer::thread_budget_ = 0;
+int LibavStreamer::threads_in_use_ = 0;
+
+void LibavStreamer::setThreadBudget(int threads)
+{
+  boost::mutex::scoped_lock lock(thread_budget_mutex_);
+  thread_budget_ = std::max(threads, 0);
+}
+
 LibavStreamer::~LibavStreamer()
 {
+  if (reserved_threads_ > 0)
+  {
+    boost::mutex::scoped_lock lock(thread_budget_mutex_);
+    threads_in_use_ -= reserved_threads_;
+    boost::shared_ptr<EncoderPool> encoder_pool = encoder_pool_.lock();
+    if (encoder_pool)
+      encoder_pool->releaseThreads(reserved_threads_);
+  }
   if (codec_context_)
     avcodec_close(codec_context_);
   if (frame_)
@@ -76,7 +113,15 @@ LibavStreamer::~LibavStreamer()
 #endif
   }
   if (format_context_)
+  {
+    // Custom IO contexts are not freed with the format context
+    if (format_context_->pb)
+    {
+      av_free(format_context_->pb->buffer);
+      av_free(format_context_->pb);
+    }
     avformat_free_context(format_context_);
+  }
   if (picture_)
   {
     avpicture_free(picture_);
@@ -92,7 +137,7 @@ LibavStreamer::~LibavStreamer()
     sws_freeContext(sws_context_);
 }
 
-void LibavStreamer::initialize(const cv::Mat &img)
+void LibavStreamer::initialize()
 {
   // Load format
   format_context_ = avformat_alloc_context();
@@ -138,7 +183,8 @@ void LibavStreamer::initialize(const cv::Mat &img)
   // Set options
   avcodec_get_context_defaults3(codec_context_, codec_);
 
-  codec_context_->codec_id = output_format_->video_codec;
+  // The muxer default differs between builds, webm defaults to VP8 or VP9
+  codec_context_->codec_id = codec_->id;
   codec_context_->bit_rate = bitrate_;
 
   codec_context_->width = output_width_;
@@ -189,76 +235,398 @@ void LibavStreamer::initialize(const cv::Mat &img)
 
   output_format_->flags |= AVFMT_NOFILE;
 
-  // Generate header
-  std::vector<uint8_t> header_buffer;
-  std::size_t header_size;
-  uint8_t *header_raw_buffer;
+  // Mux into a persistent AVIO context that writes straight into pooled buffers, the buffers are handed to the
+  // connections as they are and reused once every connection has written them
+  unsigned char *io_buffer = (unsigned char *)av_malloc(io_buffer_size);
+  if (io_buffer)
+    format_context_->pb = avio_alloc_context(io_buffer, io_buffer_size, AVIO_FLAG_WRITE, this, NULL,
+                                             &LibavStreamer::writePacket, NULL);
+  if (!format_context_->pb)
+  {
+    av_free(io_buffer);
+    async_web_server_cpp::HttpReply::stock_reply(async_web_server_cpp::HttpReply::internal_server_error)(request_,
+                                                                                                         connection_,
+                                                                                                         NULL, NULL);
+    throw std::runtime_error("Error allocating output context");
+  }
+
   // define meta data
   av_dict_set(&format_context_->metadata, "author", "ROS web_video_server", 0);
   av_dict_set(&format_context_->metadata, "title", topic_.c_str(), 0);
 
-  if (avio_open_dyn_buf(&format_context_->pb) >= 0)
+  // Generate header
+  AVDictionary *format_options = NULL;
+  initializeMuxer(&format_options);
+  output_buffer_ = buffer_pool_->acquire();
+  int write_header_result = avformat_write_header(format_context_, &format_options);
+  av_dict_free(&format_options);
+  if (write_header_result < 0)
   {
-    if (avformat_write_header(format_context_, NULL) < 0)
-    {
-      async_web_server_cpp::HttpReply::stock_reply(async_web_server_cpp::HttpReply::internal_server_error)(request_,
-                                                                                                           connection_,
-                                                                                                           NULL, NULL);
-      throw std::runtime_error("Error openning dynamic buffer");
-    }
-    header_size = avio_close_dyn_buf(format_context_->pb, &header_raw_buffer);
-
-    // copy header buffer to vector
-    header_buffer.resize(header_size);
-    memcpy(&header_buffer[0], header_raw_buffer, header_size);
-
-    av_free(header_raw_buffer);
+    async_web_server_cpp::HttpReply::stock_reply(async_web_server_cpp::HttpReply::internal_server_error)(request_,
+                                                                                                         connection_,
+                                                                                                         NULL, NULL);
+    throw std::runtime_error("Error writing stream header");
   }
+  avio_flush(format_context_->pb);
+  FrameBufferPtr header_buffer = output_buffer_;
+  output_buffer_.reset();
+
+  boost::mutex::scoped_lock lock(sinks_mutex_);
+  // Keep the header around for clients joining later on
+  header_buffer_ = header_buffer;
+  for (std::vector<SinkPtr>::iterator itr = sinks_.begin(); itr != sinks_.end(); ++itr)
+  {
+    sendStreamHeader(*itr);
+  }
+}
 
+int LibavStreamer::writePacket(void *opaque, uint8_t *buf, int buf_size)
+{
+  LibavStreamer *streamer = static_cast<LibavStreamer *>(opaque);
+  // Only called from within avformat_write_header and av_write_frame, which always provide an output buffer
+  streamer->output_buffer_->insert(streamer->output_buffer_->end(), buf, buf + buf_size);
+  return buf_size;
+}
+
+void LibavStreamer::sendStreamHeader(const SinkPtr &sink)
+{
   // Send response headers
   async_web_server_cpp::HttpReply::builder(async_web_server_cpp::HttpReply::ok).header("Connection", "close").header(
       "Server", "web_video_server").header("Cache-Control",
                                            "no-cache, no-store, must-revalidate, pre-check=0, post-check=0, max-age=0").header(
       "Pragma", "no-cache").header("Expires", "0").header("Max-Age", "0").header("Trailer", "Expires").header(
-      "Content-type", content_type_).header("Access-Control-Allow-Origin", "*").write(connection_);
+      "Content-type", content_type_).header("Access-Control-Allow-Origin", "*").write(sink->connection);
+
+  // The client reads the ring whenever it has received everything written to it so far
+  sink->throttled_connection->setReadyCallback(
+      boost::bind(&LibavStreamer::sinkReady, this, boost::weak_ptr<Sink>(sink)), shared_from_this());
 
   // Send video stream header
-  connection_->write_and_clear(header_buffer);
+  sink->throttled_connection->write(std::vector<boost::asio::const_buffer>(1, boost::asio::buffer(*header_buffer_)),
+                                    header_buffer_);
+}
+
+void LibavStreamer::start()
+{
+  ImageTransportImageStreamer::start();
+  boost::mutex::scoped_lock lock(sinks_mutex_);
+  subscribed_ = true;
+  updatePriority();
+}
+
+bool LibavStreamer::addConnection(async_web_server_cpp::HttpConnectionPtr connection, EncoderPool::Priority priority)
+{
+  boost::mutex::scoped_lock lock(sinks_mutex_);
+  if (inactive_)
+    return false;
+  // Without a flush after every frame a keyframe can land in the middle of a cluster or fragment, which a client
+  // starting there can not decode
+  if (header_buffer_ && !(flush_every_frame_ && (output_format_->flags & AVFMT_ALLOW_FLUSH)))
+    return false;
+
+  SinkPtr sink(new Sink());
+  sink->connection = connection;
+  sink->throttled_connection.reset(new ThrottledConnection(connection));
+  sink->cursor = 0;
+  sink->waiting_for_keyframe = false;
+  sink->priority = priority;
+  // Before the first frame the header is sent to everyone by initialize
+  if (header_buffer_)
+  {
+    sendStreamHeader(sink);
+    sink->cursor = ring_->getHead();
+    sink->waiting_for_keyframe = true;
+    force_keyframe_ = true;
+  }
+  sinks_.push_back(sink);
+  updatePriority();
+  return true;
+}
+
+bool LibavStreamer::hasConnection(async_web_server_cpp::HttpConnectionPtr connection)
+{
+  boost::mutex::scoped_lock lock(sinks_mutex_);
+  for (std::vector<SinkPtr>::iterator itr = sinks_.begin(); itr != sinks_.end(); ++itr)
+  {
+    if ((*itr)->connection == connection)
+      return true;
+  }
+  return false;
+}
+
+void LibavStreamer::pollSink(Sink &sink)
+{
+  // Clients that joined before the stream header was written get it from initialize first
+  if (!header_buffer_)
+    return;
+
+  // Only one frame is written at a time, the next one is read once the connection drains
+  while (sink.throttled_connection->isReady())
+  {
+    FrameRing::FramePtr frame;
+    if (!sink.waiting_for_keyframe)
+    {
+      frame = ring_->getFrame(sink.cursor + 1);
+      if (!frame && sink.cursor >= ring_->getHead())
+        return;
+      // Frames depend on each other, a client the encoder has lapped has to start over at a keyframe
+      if (!frame)
+        sink.waiting_for_keyframe = true;
+    }
+    if (sink.waiting_for_keyframe)
+    {
+      frame = ring_->getLatestKeyFrame(sink.cursor);
+      if (!frame)
+      {
+        // Only ask for a keyframe once a client that missed frames can actually take it
+        force_keyframe_ = true;
+        return;
+      }
+      sink.waiting_for_keyframe = false;
+    }
+    sink.cursor = frame->sequence;
+    sink.throttled_connection->write(std::vector<boost::asio::const_buffer>(1, boost::asio::buffer(*frame->data)),
+                                     frame->data);
+  }
+}
+
+void LibavStreamer::pollSinks()
+{
+  boost::mutex::scoped_lock lock(sinks_mutex_);
+  std::vector<SinkPtr>::iterator itr = sinks_.begin();
+  while (itr != sinks_.end())
+  {
+    try
+    {
+      pollSink(**itr);
+      ++itr;
+    }
+    catch (boost::system::system_error &e)
+    {
+      // happens when client disconnects
+      ROS_DEBUG("system_error exception: %s", e.what());
+      itr = sinks_.erase(itr);
+    }
+  }
+  if (sinks_.empty())
+    inactive_ = true;
+  updatePriority();
+}
+
+void LibavStreamer::sinkReady(boost::weak_ptr<Sink> weak_sink)
+{
+  boost::mutex::scoped_lock lock(sinks_mutex_);
+  SinkPtr sink = weak_sink.lock();
+  if (!sink)
+    return;
+  try
+  {
+    pollSink(*sink);
+  }
+  catch (boost::system::system_error &e)
+  {
+    // happens when client disconnects
+    ROS_DEBUG("system_error exception: %s", e.what());
+    sinks_.erase(std::remove(sinks_.begin(), sinks_.end(), sink), sinks_.end());
+    if (sinks_.empty())
+      inactive_ = true;
+    updatePriority();
+  }
+}
+
+void LibavStreamer::updatePriority()
+{
+  if (!subscribed_ || sinks_.empty())
+    return;
+  EncoderPool::Priority priority = EncoderPool::LOW_PRIORITY;
+  for (std::vector<SinkPtr>::iterator itr = sinks_.begin(); itr != sinks_.end(); ++itr)
+    priority = std::max(priority, (*itr)->priority);
+  queue_->setPriority(priority);
+}
+
+bool LibavStreamer::prepareSinks()
+{
+  boost::mutex::scoped_lock lock(sinks_mutex_);
+  bool wanted = false;
+  uint64_t head = ring_->getHead();
+  std::vector<SinkPtr>::iterator itr = sinks_.begin();
+  while (itr != sinks_.end())
+  {
+    try
+    {
+      bool ready = (*itr)->throttled_connection->isReady();
+      if (ready && (*itr)->waiting_for_keyframe)
+        force_keyframe_ = true;
+      // Clients that have not read the previous frame yet would only fall further behind
+      if (ready || (*itr)->cursor >= head)
+        wanted = true;
+      ++itr;
+    }
+    catch (boost::system::system_error &e)
+    {
+      // happens when client disconnects
+      ROS_DEBUG("system_error exception: %s", e.what());
+      itr = sinks_.erase(itr);
+    }
+  }
+  if (sinks_.empty())
+    inactive_ = true;
+  updatePriority();
+  return wanted;
 }
 
 void LibavStreamer::initializeEncoder()
 {
 }
 
+void LibavStreamer::initializeMuxer(AVDictionary **)
+{
+}
+
+int64_t LibavStreamer::getFramePts(double)
+{
+  return AV_NOPTS_VALUE;
+}
+
+int LibavStreamer::reserveThreads(int requested)
+{
+  boost::mutex::scoped_lock lock(thread_budget_mutex_);
+  int threads = requested;
+  if (threads <= 0)
+  {
+    // About one thread per VGA sized area, more stop paying off for realtime encoding
+    threads = std::min(std::max(output_width_ * output_height_ / (640 * 480), 1), 8);
+  }
+  // Explicit counts come from the client and are held to the budget as well. Every stream encodes on the worker
+  // thread calling it, the budget only covers the threads libav adds to that one.
+  threads = std::min(threads, 1 + thread_budget_ - threads_in_use_);
+  // Streams beyond the budget still need a thread to encode on
+  threads = std::max(threads, 1);
+  threads_in_use_ += threads - 1;
+  reserved_threads_ += threads - 1;
+  if (threads > 1)
+  {
+    encoder_pool_ = topic_hub_->getEncoderPool();
+    encoder_pool_.lock()->reserveThreads(threads - 1);
+  }
+  return threads;
+}
+
 void LibavStreamer::sendImage(const cv::Mat &img, const ros::Time &time)
 {
   boost::mutex::scoped_lock lock(encode_mutex_);
-  if (first_image_timestamp_.isZero())
+  // Nobody would read the frame any time soon, so do not spend time encoding it
+  if (!prepareSinks())
+    return;
+
+  // Grayscale images only provide the luma plane
+#if (LIBAVUTIL_VERSION_MAJOR < 52)
+  PixelFormat input_coding_format = img.channels() == 1 ? PIX_FMT_GRAY8 : PIX_FMT_BGR24;
+#else
+  AVPixelFormat input_coding_format = img.channels() == 1 ? PIX_FMT_GRAY8 : PIX_FMT_BGR24;
+#endif
+
+  // Convert from opencv to libav
+  convertImage(img.data, img.step, input_coding_format, img.cols, img.rows);
+  encodeFrame(time);
+}
+
+bool LibavStreamer::sendRawImage(const sensor_msgs::ImageConstPtr &msg)
+{
+  namespace enc = sensor_msgs::image_encodings;
+#if (LIBAVUTIL_VERSION_MAJOR < 52)
+  PixelFormat input_coding_format;
+#else
+  AVPixelFormat input_coding_format;
+#endif
+  if (msg->encoding == enc::BGR8)
+    input_coding_format = PIX_FMT_BGR24;
+  else if (msg->encoding == enc::RGB8)
+    input_coding_format = PIX_FMT_RGB24;
+  else if (msg->encoding == enc::BGRA8)
+    input_coding_format = PIX_FMT_BGRA;
+  else if (msg->encoding == enc::RGBA8)
+    input_coding_format = PIX_FMT_RGBA;
+  else if (msg->encoding == enc::MONO8)
+    input_coding_format = PIX_FMT_GRAY8;
+  else if (msg->encoding == enc::MONO16)
+    input_coding_format = msg->is_bigendian ? PIX_FMT_GRAY16BE : PIX_FMT_GRAY16LE;
+  else if (msg->encoding == enc::YUV422)
+    input_coding_format = PIX_FMT_UYVY422;
+#if (LIBAVUTIL_VERSION_MICRO >= 100 && LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(54, 7, 100))
+  // Bayer input is only supported by FFmpeg's libswscale
+  else if (msg->encoding == enc::BAYER_RGGB8)
+    input_coding_format = AV_PIX_FMT_BAYER_RGGB8;
+  else if (msg->encoding == enc::BAYER_BGGR8)
+    input_coding_format = AV_PIX_FMT_BAYER_BGGR8;
+  else if (msg->encoding == enc::BAYER_GBRG8)
+    input_coding_format = AV_PIX_FMT_BAYER_GBRG8;
+  else if (msg->encoding == enc::BAYER_GRBG8)
+    input_coding_format = AV_PIX_FMT_BAYER_GRBG8;
+#endif
+  else
+    return false;
+
+  // libswscale reads whole rows straight from the buffer, so a truncated message must not get that far
+  uint64_t row_size = (uint64_t)msg->width * enc::numChannels(msg->encoding) * enc::bitDepth(msg->encoding) / 8;
+  if (msg->data.empty() || msg->step < row_size || (uint64_t)msg->step * msg->height > msg->data.size())
   {
-    first_image_timestamp_ = time;
+    ROS_WARN_THROTTLE(30, "Dropping %ux%u %s image with step %u and %lu bytes of data", msg->width, msg->height,
+                      msg->encoding.c_str(), msg->step, (unsigned long)msg->data.size());
+    return true;
   }
-  std::vector<uint8_t> encoded_frame;
+
+  boost::mutex::scoped_lock lock(encode_mutex_);
+  if (!prepareSinks())
+    return true;
+
+  // Convert and scale straight from the message buffer
+  convertImage(&msg->data[0], msg->step, input_coding_format, msg->width, msg->height);
+  encodeFrame(msg->header.stamp);
+  return true;
+}
+
 #if (LIBAVUTIL_VERSION_MAJOR < 52)
-  PixelFormat input_coding_format = PIX_FMT_BGR24;
+void LibavStreamer::convertImage(const uint8_t *data, int step, PixelFormat format, int width, int height)
 #else
-  AVPixelFormat input_coding_format = PIX_FMT_BGR24;
+void LibavStreamer::convertImage(const uint8_t *data, int step, AVPixelFormat format, int width, int height)
 #endif
-  avpicture_fill(tmp_picture_, img.data, input_coding_format, output_width_, output_height_);
+{
+  avpicture_fill(tmp_picture_, const_cast<uint8_t*>(data), format, width, height);
+  // Rows of images viewing a message buffer may be padded
+  tmp_picture_->linesize[0] = step;
 
-  // Convert from opencv to libav
+  static int sws_flags = SWS_BICUBIC;
+  sws_context_ = sws_getCachedContext(sws_context_, width, height, format, output_width_, output_height_,
+                                      codec_context_->pix_fmt, sws_flags, NULL, NULL, NULL);
   if (!sws_context_)
   {
-    static int sws_flags = SWS_BICUBIC;
-    sws_context_ = sws_getContext(output_width_, output_height_, input_coding_format, output_width_, output_height_,
-                                  codec_context_->pix_fmt, sws_flags, NULL, NULL, NULL);
-    if (!sws_context_)
-    {
-      throw std::runtime_error("Could not initialize the conversion context");
-    }
+    throw std::runtime_error("Could not initialize the conversion context");
   }
 
-  int ret = sws_scale(sws_context_, (const uint8_t * const *)tmp_picture_->data, tmp_picture_->linesize, 0,
-                      output_height_, picture_->data, picture_->linesize);
+  sws_scale(sws_context_, (const uint8_t * const *)tmp_picture_->data, tmp_picture_->linesize, 0, height,
+            picture_->data, picture_->linesize);
+}
+
+void LibavStreamer::encodeFrame(const ros::Time &time)
+{
+  if (first_image_timestamp_.isZero())
+  {
+    first_image_timestamp_ = time;
+  }
+  FrameBufferPtr encoded_frame;
+  bool key_frame = false;
+  frame_->pts = getFramePts((time - first_image_timestamp_).toSec());
+
+  // Let clients that just joined start decoding as soon as possible
+  if (force_keyframe_.exchange(false))
+  {
+    frame_->pict_type = AV_PICTURE_TYPE_I;
+  }
+  else
+  {
+    frame_->pict_type = AV_PICTURE_TYPE_NONE;
+  }
 
   // Encode the frame
   AVPacket pkt;
@@ -281,38 +649,38 @@ void LibavStreamer::sendImage(const cv::Mat &img, const ros::Time &time)
 
   if (got_packet)
   {
-    std::size_t size;
-    uint8_t *output_buf;
-
     double seconds = (time - first_image_timestamp_).toSec();
     // Encode video at 1/0.95 to minimize delay
     pkt.pts = (int64_t)(seconds / av_q2d(video_stream_->time_base) * 0.95);
     if (pkt.pts <= 0)
       pkt.pts = 1;
+    // Muxers reject timestamps that do not increase, which happens for images with repeated or reordered stamps
+    if (pkt.pts <= last_packet_pts_)
+      pkt.pts = last_packet_pts_ + 1;
+    last_packet_pts_ = pkt.pts;
     pkt.dts = AV_NOPTS_VALUE;
 
     if (codec_context_->coded_frame->key_frame)
       pkt.flags |= AV_PKT_FLAG_KEY;
+    key_frame = pkt.flags & AV_PKT_FLAG_KEY;
 
     pkt.stream_index = video_stream_->index;
 
-    if (avio_open_dyn_buf(&format_context_->pb) >= 0)
+    output_buffer_ = buffer_pool_->acquire();
+    if (av_write_frame(format_context_, &pkt))
     {
-      if (av_write_frame(format_context_, &pkt))
-      {
-        throw std::runtime_error("Error when writing frame");
-      }
-      size = avio_close_dyn_buf(format_context_->pb, &output_buf);
-
-      encoded_frame.resize(size);
-      memcpy(&encoded_frame[0], output_buf, size);
-
-      av_free(output_buf);
+      output_buffer_.reset();
+      throw std::runtime_error("Error when writing frame");
     }
-  }
-  else
-  {
-    encoded_frame.clear();
+    // Fragmenting muxers only write out buffered packets when flushed
+    if (flush_every_frame_ && av_write_frame(format_context_, NULL) < 0)
+    {
+      output_buffer_.reset();
+      throw std::runtime_error("Error when flushing frame");
+    }
+    avio_flush(format_context_->pb);
+    encoded_frame = output_buffer_;
+    output_buffer_.reset();
   }
 #if (LIBAVCODEC_VERSION_MAJOR < 54)
   av_free(pkt.data);
@@ -320,21 +688,99 @@ void LibavStreamer::sendImage(const cv::Mat &img, const ros::Time &time)
 
   av_free_packet(&pkt);
 
-  connection_->write_and_clear(encoded_frame);
+  if (encoded_frame && !encoded_frame->empty())
+  {
+    ring_->publish(encoded_frame, time, key_frame);
+    pollSinks();
+  }
+}
+
+SharedLibavStreamer::SharedLibavStreamer(const async_web_server_cpp::HttpRequest &request,
+                                         async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                                         boost::shared_ptr<ImageTopicHub> topic_hub,
+                                         boost::shared_ptr<LibavStreamer> encoder) :
+    ImageStreamer(request, connection, nh, topic_hub), encoder_(encoder)
+{
+}
+
+void SharedLibavStreamer::start()
+{
+  // Images are received and encoded by the shared encoder
+}
+
+bool SharedLibavStreamer::isInactive()
+{
+  return encoder_->isInactive() || !encoder_->hasConnection(connection_);
 }
 
-LibavStreamerType::LibavStreamerType(const std::string &format_name, const std::string &codec_name,
-                                     const std::string &content_type) :
-    format_name_(format_name), codec_name_(codec_name), content_type_(content_type)
+LibavStreamerType::LibavStreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, const std::string &format_name,
+                                     const std::string &codec_name, const std::string &content_type,
+                                     int encoder_threads) :
+    topic_hub_(topic_hub), format_name_(format_name), codec_name_(codec_name), content_type_(content_type)
 {
+  // The budget is shared by the streams of all libav types
+  LibavStreamer::setThreadBudget(encoder_threads);
 }
 
 boost::shared_ptr<ImageStreamer> LibavStreamerType::create_streamer(const async_web_server_cpp::HttpRequest &request,
                                                                     async_web_server_cpp::HttpConnectionPtr connection,
                                                                     ros::NodeHandle& nh)
 {
-  return boost::shared_ptr<ImageStreamer>(
-      new LibavStreamer(request, connection, nh, format_name_, codec_name_, content_type_));
+  if (!request.has_query_param("shared"))
+  {
+    boost::shared_ptr<LibavStreamer> streamer = create_libav_streamer(request, connection, nh);
+    streamer->setDefaultMaxFps(default_max_fps_);
+    return streamer;
+  }
+
+  // Clients asking for the same stream share a single encoder
+  std::string key = shared_encoder_key(request);
+  boost::mutex::scoped_lock lock(shared_encoders_mutex_);
+  std::map<std::string, boost::weak_ptr<LibavStreamer> >::iterator itr = shared_encoders_.begin();
+  while (itr != shared_encoders_.end())
+  {
+    if (itr->second.expired())
+      shared_encoders_.erase(itr++);
+    else
+      ++itr;
+  }
+
+  boost::shared_ptr<LibavStreamer> encoder = shared_encoders_[key].lock();
+  EncoderPool::Priority priority = EncoderPool::parsePriority(
+      request.get_query_param_value_or_default("priority", ""), EncoderPool::NORMAL_PRIORITY);
+  if (encoder && encoder->addConnection(connection, priority))
+  {
+    return boost::shared_ptr<ImageStreamer>(new SharedLibavStreamer(request, connection, nh, topic_hub_, encoder));
+  }
+
+  encoder = create_libav_streamer(request, connection, nh);
+  encoder->setDefaultMaxFps(default_max_fps_);
+  shared_encoders_[key] = encoder;
+  return encoder;
+}
+
+boost::shared_ptr<LibavStreamer> LibavStreamerType::create_libav_streamer(
+    const async_web_server_cpp::HttpRequest &request, async_web_server_cpp::HttpConnectionPtr connection,
+    ros::NodeHandle& nh)
+{
+  return boost::shared_ptr<LibavStreamer>(
+      new LibavStreamer(request, connection, nh, topic_hub_, format_name_, codec_name_, content_type_));
+}
+
+std::string LibavStreamerType::shared_encoder_key(const async_web_server_cpp::HttpRequest &request)
+{
+  static const char* params[] = {"topic", "width", "height", "bitrate", "qmin", "qmax", "gop", "quality", "invert",
+                                 "default_transport", "max_fps", "preset", "tune", "crf",
+                                 "threads", "cpu_used", "token_partitions", "tile_columns"};
+  std::stringstream ss;
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); ++i)
+  {
+    ss << params[i];
+    if (request.has_query_param(params[i]))
+      ss << "=" << request.get_query_param_value_or_default(params[i], "");
+    ss << "&";
+  }
+  return ss.str();
 }
 
 std::string LibavStreamerType::create_viewer(const async_web_server_cpp::HttpRequest &request)
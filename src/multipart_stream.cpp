@@ -1,11 +1,13 @@
 #include "web_video_server/multipart_stream.h"
 #include "async_web_server_cpp/http_reply.hpp"
+#include <cstring>
 
 namespace web_video_server
 {
 
 MultipartStream::MultipartStream(async_web_server_cpp::HttpConnectionPtr& connection, const std::string& boundry)
-  : connection_(connection), boundry_(boundry) {}
+  : connection_(connection), throttled_connection_(new ThrottledConnection(connection)), boundry_(boundry),
+    part_footer_(new std::string("\r\n--"+boundry+"\r\n")), header_pool_(new BufferPool()) {}
 
 void MultipartStream::sendInitialHeader() {
   async_web_server_cpp::HttpReply::builder(async_web_server_cpp::HttpReply::ok).header("Connection", "close").header(
@@ -16,36 +18,84 @@ void MultipartStream::sendInitialHeader() {
   connection_->write("--"+boundry_+"\r\n");
 }
 
-void MultipartStream::sendPartHeader(const ros::Time &time, const std::string& type, size_t payload_size) {
-  char stamp[20];
-  sprintf(stamp, "%.06lf", time.toSec());
-  boost::shared_ptr<std::vector<async_web_server_cpp::HttpHeader> > headers(
-      new std::vector<async_web_server_cpp::HttpHeader>());
-  headers->push_back(async_web_server_cpp::HttpHeader("Content-type", type));
-  headers->push_back(async_web_server_cpp::HttpHeader("X-Timestamp", stamp));
-  headers->push_back(
-      async_web_server_cpp::HttpHeader("Content-Length", boost::lexical_cast<std::string>(payload_size)));
-  connection_->write(async_web_server_cpp::HttpReply::to_buffers(*headers), headers);
+void MultipartStream::sendPart(const ros::Time &time, const std::string& type, FrameBufferPtr frame) {
+  sendPart(time, type, boost::asio::buffer(*frame), frame);
 }
 
-void MultipartStream::sendPartFooter() {
-  connection_->write("\r\n--"+boundry_+"\r\n");
-}
-
-void MultipartStream::sendPartAndClear(const ros::Time &time, const std::string& type,
-				       std::vector<unsigned char> &data) {
-  sendPartHeader(time, type, data.size());
-  connection_->write_and_clear(data);
-  sendPartFooter();
+void MultipartStream::sendPart(const ros::Time &time, const std::string& type,
+			       const boost::asio::const_buffer &buffer,
+			       async_web_server_cpp::HttpConnection::ResourcePtr resource) {
+  sendPart(time, type, std::vector<boost::asio::const_buffer>(1, buffer), resource);
 }
 
 void MultipartStream::sendPart(const ros::Time &time, const std::string& type,
-			       const boost::asio::const_buffer &buffer,
+			       const std::vector<boost::asio::const_buffer> &payload,
 			       async_web_server_cpp::HttpConnection::ResourcePtr resource) {
-  sendPartHeader(time, type, boost::asio::buffer_size(buffer));
-  connection_->write(buffer, resource);
-  sendPartFooter();
+  // The header only changes in the timestamp and length, so it is filled in from a template into a pooled buffer
+  if (type != part_header_type_) {
+    part_header_type_ = type;
+    part_header_prefix_ = "Content-type: " + type + "\r\nX-Timestamp: ";
+  }
+  BufferPool::BufferPtr header = header_pool_->acquire();
+  header->assign(part_header_prefix_.begin(), part_header_prefix_.end());
+  appendTimestamp(*header, time);
+  appendString(*header, "\r\nContent-Length: ");
+  appendDecimal(*header, boost::asio::buffer_size(payload));
+  appendString(*header, "\r\n\r\n");
+
+  std::vector<boost::asio::const_buffer> buffers;
+  buffers.reserve(payload.size() + 2);
+  buffers.push_back(boost::asio::buffer(*header));
+  buffers.insert(buffers.end(), payload.begin(), payload.end());
+  buffers.push_back(boost::asio::buffer(*part_footer_));
+
+  // Keep everything the buffers point into alive until the part is written
+  boost::shared_ptr<PartResources> resources(new PartResources());
+  resources->header = header;
+  resources->payload = resource;
+  resources->footer = part_footer_;
+  throttled_connection_->sendFrame(buffers, resources);
+}
+
+void MultipartStream::appendString(std::vector<uint8_t> &buffer, const char *str) {
+  buffer.insert(buffer.end(), str, str + strlen(str));
 }
 
+void MultipartStream::appendDecimal(std::vector<uint8_t> &buffer, uint64_t value, int min_digits) {
+  char digits[20];
+  int count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0 || count < min_digits);
+  while (count > 0)
+    buffer.push_back(digits[--count]);
+}
+
+void MultipartStream::appendTimestamp(std::vector<uint8_t> &buffer, const ros::Time &time) {
+  // Seconds with microsecond precision, like printf's %.06lf
+  uint64_t sec = time.sec;
+  uint32_t usec = (time.nsec + 500) / 1000;
+  if (usec >= 1000000) {
+    ++sec;
+    usec -= 1000000;
+  }
+  appendDecimal(buffer, sec);
+  buffer.push_back('.');
+  appendDecimal(buffer, usec, 6);
+}
+
+double MultipartStream::getDrainRate() {
+  return throttled_connection_->getDrainRate();
+}
+
+bool MultipartStream::isReady() {
+  return throttled_connection_->isReady();
+}
+
+void MultipartStream::setReadyCallback(const boost::function<void()> &callback,
+                                       const boost::weak_ptr<void> &tracked_object) {
+  throttled_connection_->setReadyCallback(callback, tracked_object);
+}
 
 }
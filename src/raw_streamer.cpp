@@ -0,0 +1,129 @@
+#include "web_video_server/raw_streamer.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+namespace web_video_server
+{
+
+static void append_uint32(std::vector<uint8_t> &buffer, uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+    buffer.push_back((value >> (8 * i)) & 0xff);
+}
+
+RawStreamer::RawStreamer(const async_web_server_cpp::HttpRequest &request,
+                         async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                         boost::shared_ptr<ImageTopicHub> topic_hub) :
+  ImageTransportImageStreamer(request, connection, nh, topic_hub), stream_(connection), lz4_(false),
+  buffer_pool_(new BufferPool())
+{
+  std::string compression = request.get_query_param_value_or_default("compression", "none");
+  if (compression == "lz4")
+  {
+#ifdef HAVE_LZ4
+    lz4_ = true;
+#else
+    ROS_WARN("web_video_server was built without LZ4, sending raw images uncompressed");
+#endif
+  }
+  else if (compression != "none")
+  {
+    ROS_WARN_STREAM("Unknown raw image compression '" << compression << "', sending raw images uncompressed");
+  }
+  stream_.sendInitialHeader();
+}
+
+bool RawStreamer::sendRawImage(const sensor_msgs::ImageConstPtr &msg)
+{
+  if ((int)msg->width != output_width_ || (int)msg->height != output_height_)
+    return false;
+
+  sendFrame(msg->width, msg->height, msg->step, msg->encoding, msg->is_bigendian, msg->header.stamp,
+            msg->data.empty() ? NULL : &msg->data[0], msg->data.size(), msg);
+  return true;
+}
+
+void RawStreamer::sendImage(const cv::Mat &img, const ros::Time &time)
+{
+  // Shares the pixels, the image may be a view of the message buffer
+  boost::shared_ptr<cv::Mat> image(new cv::Mat(img));
+  sendFrame(img.cols, img.rows, img.step, img.channels() == 1 ? "mono8" : "bgr8", false, time, img.data,
+            img.step * img.rows, image);
+}
+
+void RawStreamer::sendFrame(uint32_t width, uint32_t height, uint32_t step, const std::string &encoding,
+                            bool is_bigendian, const ros::Time &time, const uint8_t *data, std::size_t size,
+                            async_web_server_cpp::HttpConnection::ResourcePtr resource)
+{
+  boost::asio::const_buffer payload(data, size);
+  uint8_t compression = 0;
+#ifdef HAVE_LZ4
+  if (lz4_ && size > 0)
+  {
+    BufferPool::BufferPtr compressed = buffer_pool_->acquire();
+    compressed->resize(LZ4_compressBound(size));
+    int compressed_size = LZ4_compress_default(reinterpret_cast<const char *>(data),
+                                               reinterpret_cast<char *>(&(*compressed)[0]), size,
+                                               compressed->size());
+    if (compressed_size <= 0)
+      throw std::runtime_error("LZ4 compression failed");
+    compressed->resize(compressed_size);
+    payload = boost::asio::buffer(*compressed);
+    resource = compressed;
+    compression = 1;
+  }
+#endif
+
+  boost::shared_ptr<std::vector<uint8_t> > header(new std::vector<uint8_t>());
+  header->reserve(27 + encoding.size());
+  append_uint32(*header, width);
+  append_uint32(*header, height);
+  append_uint32(*header, step);
+  append_uint32(*header, time.sec);
+  append_uint32(*header, time.nsec);
+  append_uint32(*header, size);
+  header->push_back(is_bigendian ? 1 : 0);
+  header->push_back(compression);
+  std::size_t encoding_length = std::min<std::size_t>(encoding.size(), 255);
+  header->push_back(encoding_length);
+  header->insert(header->end(), encoding.begin(), encoding.begin() + encoding_length);
+
+  std::vector<boost::asio::const_buffer> buffers;
+  buffers.push_back(boost::asio::buffer(*header));
+  buffers.push_back(payload);
+  boost::shared_ptr<std::vector<async_web_server_cpp::HttpConnection::ResourcePtr> > resources(
+      new std::vector<async_web_server_cpp::HttpConnection::ResourcePtr>());
+  resources->push_back(header);
+  resources->push_back(resource);
+  stream_.sendPart(time, "application/octet-stream", buffers, resources);
+}
+
+RawStreamerType::RawStreamerType(boost::shared_ptr<ImageTopicHub> topic_hub) :
+    topic_hub_(topic_hub)
+{
+}
+
+boost::shared_ptr<ImageStreamer> RawStreamerType::create_streamer(const async_web_server_cpp::HttpRequest &request,
+                                                                  async_web_server_cpp::HttpConnectionPtr connection,
+                                                                  ros::NodeHandle& nh)
+{
+  boost::shared_ptr<ImageStreamer> streamer(new RawStreamer(request, connection, nh, topic_hub_));
+  streamer->setDefaultMaxFps(default_max_fps_);
+  return streamer;
+}
+
+std::string RawStreamerType::create_viewer(const async_web_server_cpp::HttpRequest &request)
+{
+  // Browsers can not show raw images, link the stream for other clients instead
+  std::stringstream ss;
+  ss << "<p>Raw image stream: <a href=\"/stream?";
+  ss << request.query;
+  ss << "\">/stream?";
+  ss << request.query;
+  ss << "</a></p>";
+  return ss.str();
+}
+
+}
@@ -1,22 +1,86 @@
 #include "web_video_server/ros_compressed_streamer.h"
+#include <algorithm>
 
 namespace web_video_server
 {
 
+#ifndef HAVE_TURBOJPEG
+// Reads the size of a JPEG or PNG image from its header, returns false for other formats. Builds with libturbojpeg
+// read JPEG headers with JpegDecoder instead.
+static bool read_image_size(const std::vector<uint8_t> &data, int &width, int &height)
+{
+  // PNG starts with its signature and the IHDR chunk, which holds the width and height as big endian integers
+  static const uint8_t png_signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  if (data.size() >= 24 && std::equal(png_signature, png_signature + 8, data.begin()))
+  {
+    uint32_t png_width = ((uint32_t)data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+    uint32_t png_height = ((uint32_t)data[20] << 24) | (data[21] << 16) | (data[22] << 8) | data[23];
+    // The format limits both to 2^31 - 1
+    width = png_width;
+    height = png_height;
+    return width > 0 && height > 0;
+  }
+
+  // JPEG marker segments are skipped up to the start of frame, which holds the height and width
+  if (data.size() < 4 || data[0] != 0xff || data[1] != 0xd8)
+    return false;
+  std::size_t pos = 2;
+  while (pos + 4 <= data.size())
+  {
+    if (data[pos] != 0xff)
+      return false;
+    uint8_t marker = data[pos + 1];
+    // Markers may be preceded by fill bytes
+    if (marker == 0xff)
+    {
+      ++pos;
+      continue;
+    }
+    // Every SOFn marker except DHT, JPG and DAC, which share the range
+    if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+    {
+      if (pos + 9 > data.size())
+        return false;
+      height = (data[pos + 5] << 8) | data[pos + 6];
+      width = (data[pos + 7] << 8) | data[pos + 8];
+      return width > 0 && height > 0;
+    }
+    // The image data starts without a frame header
+    if (marker == 0xda)
+      return false;
+    pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+  }
+  return false;
+}
+#endif
+
 RosCompressedStreamer::RosCompressedStreamer(const async_web_server_cpp::HttpRequest &request,
-                             async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh) :
-  ImageStreamer(request, connection, nh), stream_(connection)
+                             async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                             boost::shared_ptr<ImageTopicHub> topic_hub,
+                             boost::shared_ptr<JpegEncodeCache> encode_cache) :
+  ImageStreamer(request, connection, nh, topic_hub), stream_(connection), encode_cache_(encode_cache)
 {
+  output_width_ = request.get_query_param_value_or_default<int>("width", -1);
+  output_height_ = request.get_query_param_value_or_default<int>("height", -1);
+  has_quality_ = request.has_query_param("quality");
+  quality_ = request.get_query_param_value_or_default<int>("quality", 95);
+  transcode_ = output_width_ != -1 || output_height_ != -1 || has_quality_;
   stream_.sendInitialHeader();
 }
 
 void RosCompressedStreamer::start() {
-  std::string compressed_topic = topic_ + "/compressed";
-  image_sub_ = nh_.subscribe(compressed_topic, 1, &RosCompressedStreamer::imageCallback, this);
+  topic_hub_->subscribeCompressed(topic_, boost::bind(&RosCompressedStreamer::imageCallback, this, _1),
+                                  shared_from_this(), priority_);
 }
 
 void RosCompressedStreamer::imageCallback(const sensor_msgs::CompressedImageConstPtr &msg) {
+  if (inactive_ || msg->data.empty() || !acceptFrame())
+    return;
+
   try {
+    if (transcode_ && sendTranscoded(msg))
+      return;
+
     std::string content_type;
     if(msg->format.find("jpeg") != std::string::npos) {
       content_type = "image/jpeg";
@@ -53,11 +117,80 @@ void RosCompressedStreamer::imageCallback(const sensor_msgs::CompressedImageCons
 }
 
 
+bool RosCompressedStreamer::sendTranscoded(const sensor_msgs::CompressedImageConstPtr &msg) {
+  cv::Mat img;
+  int width, height;
+  // Reading the header is enough to find out whether the image can pass through, images whose header can not be
+  // read here are decoded to learn their size
+#ifdef HAVE_TURBOJPEG
+  if (!jpeg_decoder_)
+    jpeg_decoder_.reset(new JpegDecoder());
+  bool header_read = jpeg_decoder_->readHeader(&msg->data[0], msg->data.size(), width, height);
+#else
+  bool header_read = read_image_size(msg->data, width, height);
+#endif
+  if (!header_read)
+  {
+    img = cv::imdecode(msg->data, CV_LOAD_IMAGE_ANYCOLOR);
+    if (img.empty())
+      throw std::runtime_error("Could not decode compressed image");
+    width = img.cols;
+    height = img.rows;
+  }
+
+  cv::Size output_size(output_width_ == -1 ? width : output_width_, output_height_ == -1 ? height : output_height_);
+  if (!has_quality_ && output_size == cv::Size(width, height))
+    return false;
+
+  // Streams transcoding the topic to the same size and quality share their encoded frames
+  if (!encode_cache_entry_ || encode_cache_entry_size_ != output_size)
+  {
+    encode_cache_entry_ = encode_cache_->getEntry(topic_ + "/compressed", output_size.width, output_size.height,
+                                                  quality_, false);
+    encode_cache_entry_size_ = output_size;
+  }
+
+  FrameBufferPtr encoded_buffer = encode_cache_entry_->getFrame(msg->header.stamp);
+  if (!encoded_buffer)
+  {
+    if (img.empty())
+    {
+#ifdef HAVE_TURBOJPEG
+      // Only JPEGs get here without having been decoded
+      jpeg_decoder_->decode(&msg->data[0], msg->data.size(), output_size.width, output_size.height, img);
+#else
+      img = cv::imdecode(msg->data, CV_LOAD_IMAGE_ANYCOLOR);
+#endif
+      if (img.empty())
+        throw std::runtime_error("Could not decode compressed image");
+    }
+    if (img.size() != output_size)
+    {
+      cv::Mat resized;
+      cv::resize(img, resized, output_size);
+      img = resized;
+    }
+    encoded_buffer = encode_cache_entry_->encode(img, msg->header.stamp);
+  }
+  stream_.sendPart(msg->header.stamp, "image/jpeg", encoded_buffer);
+  return true;
+}
+
+
+RosCompressedStreamerType::RosCompressedStreamerType(boost::shared_ptr<ImageTopicHub> topic_hub,
+                                                     boost::shared_ptr<JpegEncodeCache> encode_cache) :
+    topic_hub_(topic_hub), encode_cache_(encode_cache)
+{
+}
+
 boost::shared_ptr<ImageStreamer> RosCompressedStreamerType::create_streamer(const async_web_server_cpp::HttpRequest &request,
 										 async_web_server_cpp::HttpConnectionPtr connection,
 										 ros::NodeHandle& nh)
 {
-  return boost::shared_ptr<ImageStreamer>(new RosCompressedStreamer(request, connection, nh));
+  boost::shared_ptr<ImageStreamer> streamer(new RosCompressedStreamer(request, connection, nh, topic_hub_,
+                                                                    encode_cache_));
+  streamer->setDefaultMaxFps(default_max_fps_);
+  return streamer;
 }
 
 std::string RosCompressedStreamerType::create_viewer(const async_web_server_cpp::HttpRequest &request)
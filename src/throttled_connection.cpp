@@ -0,0 +1,200 @@
+#include "web_video_server/throttled_connection.h"
+
+namespace web_video_server
+{
+
+// Writes completing faster than this went straight into the socket buffer and say nothing about the connection
+static const double min_busy_time = 0.001;
+
+// Keeps the written resource alive and reports back to the connection once the write is done with it
+class ThrottledConnection::WriteTracker
+{
+public:
+  WriteTracker(boost::weak_ptr<ThrottledConnection> owner, async_web_server_cpp::HttpConnection::ResourcePtr resource,
+               std::size_t size) :
+      owner_(owner), resource_(resource), size_(size)
+  {
+  }
+
+  ~WriteTracker()
+  {
+    ThrottledConnection::writeCompleted(owner_, size_);
+  }
+
+private:
+  // Only a weak reference, the connection holds on to this until the write completes
+  boost::weak_ptr<ThrottledConnection> owner_;
+  async_web_server_cpp::HttpConnection::ResourcePtr resource_;
+  std::size_t size_;
+};
+
+ThrottledConnection::ThrottledConnection(async_web_server_cpp::HttpConnectionPtr connection) :
+    connection_(connection), bytes_in_flight_(0), bytes_drained_(0), drain_rate_(0), has_pending_frame_(false)
+{
+}
+
+void ThrottledConnection::write(const std::vector<boost::asio::const_buffer> &buffers,
+                                async_web_server_cpp::HttpConnection::ResourcePtr resource)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (error_)
+      throw boost::system::system_error(error_);
+    startWrite(boost::asio::buffer_size(buffers));
+  }
+  writeTracked(buffers, resource);
+}
+
+void ThrottledConnection::sendFrame(const std::vector<boost::asio::const_buffer> &buffers,
+                                    async_web_server_cpp::HttpConnection::ResourcePtr resource)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (error_)
+      throw boost::system::system_error(error_);
+    if (bytes_in_flight_ > 0)
+    {
+      // Latest frame wins, the one it replaces is never sent
+      pending_buffers_ = buffers;
+      pending_resource_ = resource;
+      has_pending_frame_ = true;
+      lock.unlock();
+      checkConnection();
+      return;
+    }
+    startWrite(boost::asio::buffer_size(buffers));
+  }
+  writeTracked(buffers, resource);
+}
+
+bool ThrottledConnection::isReady()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (error_)
+      throw boost::system::system_error(error_);
+    if (bytes_in_flight_ == 0)
+      return true;
+  }
+  checkConnection();
+  return false;
+}
+
+double ThrottledConnection::getDrainRate()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return drain_rate_;
+}
+
+void ThrottledConnection::setReadyCallback(const boost::function<void()> &callback,
+                                           const boost::weak_ptr<void> &tracked_object)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  ready_callback_ = callback;
+  ready_tracked_object_ = tracked_object;
+}
+
+void ThrottledConnection::startWrite(std::size_t size)
+{
+  // Called with mutex_ held
+  if (bytes_in_flight_ == 0)
+  {
+    busy_since_ = ros::WallTime::now();
+    bytes_drained_ = 0;
+  }
+  bytes_in_flight_ += size;
+}
+
+void ThrottledConnection::writeCompleted(boost::weak_ptr<ThrottledConnection> weak_this, std::size_t size)
+{
+  boost::shared_ptr<ThrottledConnection> self = weak_this.lock();
+  if (!self)
+    return;
+
+  std::vector<boost::asio::const_buffer> buffers;
+  async_web_server_cpp::HttpConnection::ResourcePtr resource;
+  boost::function<void()> ready_callback;
+  boost::shared_ptr<void> tracked_object;
+  {
+    boost::mutex::scoped_lock lock(self->mutex_);
+    self->bytes_in_flight_ -= size;
+    self->bytes_drained_ += size;
+    if (self->bytes_in_flight_ > 0)
+      return;
+
+    // Only busy periods in which the data actually queued are sampled. Dividing the bytes of a write the socket took
+    // right away by a floor would report rates far above what the connection can sustain.
+    double busy_time = (ros::WallTime::now() - self->busy_since_).toSec();
+    if (busy_time > min_busy_time)
+    {
+      double rate = self->bytes_drained_ / busy_time;
+      self->drain_rate_ = self->drain_rate_ > 0 ? 0.8 * self->drain_rate_ + 0.2 * rate : rate;
+    }
+    else
+    {
+      // The connection keeps up again, an old estimate would hold the stream back
+      self->drain_rate_ = 0;
+    }
+
+    if (!self->has_pending_frame_)
+    {
+      // A failed write also ends up here, there is nothing to be ready for then
+      if (self->error_ || !self->ready_callback_)
+        return;
+      ready_callback = self->ready_callback_;
+      tracked_object = self->ready_tracked_object_.lock();
+    }
+    else
+    {
+      buffers.swap(self->pending_buffers_);
+      resource.swap(self->pending_resource_);
+      self->has_pending_frame_ = false;
+      self->startWrite(boost::asio::buffer_size(buffers));
+    }
+  }
+
+  if (ready_callback)
+  {
+    if (tracked_object)
+      ready_callback();
+    return;
+  }
+
+  // Runs wherever the last write released its resource, so errors are kept for the next frame instead of thrown
+  try
+  {
+    self->writeTracked(buffers, resource);
+  }
+  catch (boost::system::system_error &e)
+  {
+    ROS_DEBUG("system_error exception: %s", e.what());
+  }
+}
+
+void ThrottledConnection::writeTracked(const std::vector<boost::asio::const_buffer> &buffers,
+                                       async_web_server_cpp::HttpConnection::ResourcePtr resource)
+{
+  // Must not be called with mutex_ held, a failing write releases the tracker right away
+  async_web_server_cpp::HttpConnection::ResourcePtr tracker(
+      new WriteTracker(shared_from_this(), resource, boost::asio::buffer_size(buffers)));
+  try
+  {
+    connection_->write(buffers, tracker);
+  }
+  catch (boost::system::system_error &e)
+  {
+    // Recorded before tracker goes out of scope, so its completion does not report the connection as ready
+    boost::mutex::scoped_lock lock(mutex_);
+    error_ = e.code();
+    throw;
+  }
+}
+
+void ThrottledConnection::checkConnection()
+{
+  // Data queued behind a write that failed is never released, writing nothing raises the error of such a connection
+  // instead of leaving it busy forever
+  connection_->write(std::vector<boost::asio::const_buffer>(), async_web_server_cpp::HttpConnection::ResourcePtr());
+}
+
+}
@@ -40,10 +40,14 @@ namespace web_video_server
 {
 
 Vp8Streamer::Vp8Streamer(const async_web_server_cpp::HttpRequest& request,
-                         async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh) :
-    LibavStreamer(request, connection, nh, "webm", "libvpx", "video/webm")
+                         async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                         boost::shared_ptr<ImageTopicHub> topic_hub) :
+    LibavStreamer(request, connection, nh, topic_hub, "webm", "libvpx", "video/webm")
 {
   quality_ = request.get_query_param_value_or_default("quality", "realtime");
+  threads_ = request.get_query_param_value_or_default<int>("threads", 0);
+  token_partitions_ = request.get_query_param_value_or_default<int>("token_partitions", 0);
+  cpu_used_ = request.get_query_param_value_or_default("cpu_used", "");
 }
 Vp8Streamer::~Vp8Streamer()
 {
@@ -60,6 +64,8 @@ void Vp8Streamer::initializeEncoder()
   av_opt_map["rc_lookahead"] = "1";
   av_opt_map["drop_frame"] = "1";
   av_opt_map["error-resilient"] = "1";
+  if (!cpu_used_.empty())
+    av_opt_map["cpu-used"] = cpu_used_;
 
   for (AvOptMap::iterator itr = av_opt_map.begin(); itr != av_opt_map.end(); ++itr)
   {
@@ -75,18 +81,25 @@ void Vp8Streamer::initializeEncoder()
   av_opt_set_int(codec_context_->priv_data, "buf-optimal", bufsize, 0);
   codec_context_->rc_buffer_aggressivity = 0.5;
   codec_context_->frame_skip_threshold = 10;
+
+  // libvpx threads work on separate token partitions, so use as many partitions as threads
+  codec_context_->thread_count = reserveThreads(threads_);
+  int token_partitions = token_partitions_;
+  if (token_partitions <= 0)
+    token_partitions = std::min(codec_context_->thread_count, 8);
+  codec_context_->slices = token_partitions;
 }
 
-Vp8StreamerType::Vp8StreamerType() :
-    LibavStreamerType("webm", "libvpx", "video/webm")
+Vp8StreamerType::Vp8StreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, int encoder_threads) :
+    LibavStreamerType(topic_hub, "webm", "libvpx", "video/webm", encoder_threads)
 {
 }
 
-boost::shared_ptr<ImageStreamer> Vp8StreamerType::create_streamer(const async_web_server_cpp::HttpRequest& request,
-                                                                  async_web_server_cpp::HttpConnectionPtr connection,
-                                                                  ros::NodeHandle& nh)
+boost::shared_ptr<LibavStreamer> Vp8StreamerType::create_libav_streamer(const async_web_server_cpp::HttpRequest& request,
+                                                                       async_web_server_cpp::HttpConnectionPtr connection,
+                                                                       ros::NodeHandle& nh)
 {
-  return boost::shared_ptr<ImageStreamer>(new Vp8Streamer(request, connection, nh));
+  return boost::shared_ptr<LibavStreamer>(new Vp8Streamer(request, connection, nh, topic_hub_));
 }
 
 }
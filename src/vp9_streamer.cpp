@@ -0,0 +1,69 @@
+#include "web_video_server/vp9_streamer.h"
+
+namespace web_video_server
+{
+
+Vp9Streamer::Vp9Streamer(const async_web_server_cpp::HttpRequest& request,
+                         async_web_server_cpp::HttpConnectionPtr connection, ros::NodeHandle& nh,
+                         boost::shared_ptr<ImageTopicHub> topic_hub) :
+    LibavStreamer(request, connection, nh, topic_hub, "webm", "libvpx-vp9", "video/webm")
+{
+  threads_ = request.get_query_param_value_or_default<int>("threads", 0);
+  tile_columns_ = request.get_query_param_value_or_default<int>("tile_columns", 0);
+  cpu_used_ = request.get_query_param_value_or_default("cpu_used", "8");
+}
+Vp9Streamer::~Vp9Streamer()
+{
+}
+
+void Vp9Streamer::initializeEncoder()
+{
+  codec_context_->thread_count = reserveThreads(threads_);
+
+  // Tiles are at least 256 pixels wide and set as log2 of their count, one column per thread fits the row threading
+  int tile_columns = tile_columns_;
+  if (tile_columns <= 0)
+  {
+    while ((2 << tile_columns) <= codec_context_->thread_count && (256 << (tile_columns + 1)) <= output_width_)
+      ++tile_columns;
+  }
+
+  typedef std::map<std::string, std::string> AvOptMap;
+  AvOptMap av_opt_map;
+  av_opt_map["deadline"] = "realtime";
+  av_opt_map["cpu-used"] = cpu_used_;
+  av_opt_map["row-mt"] = "1";
+  av_opt_map["tile-columns"] = boost::lexical_cast<std::string>(tile_columns);
+  av_opt_map["frame-parallel"] = "0";
+  av_opt_map["auto-alt-ref"] = "0";
+  av_opt_map["lag-in-frames"] = "0";
+  av_opt_map["error-resilient"] = "1";
+  // Cyclic refresh, spreads intra coding over frames instead of bursting on keyframes
+  av_opt_map["aq-mode"] = "3";
+
+  for (AvOptMap::iterator itr = av_opt_map.begin(); itr != av_opt_map.end(); ++itr)
+  {
+    av_opt_set(codec_context_->priv_data, itr->first.c_str(), itr->second.c_str(), 0);
+  }
+
+  // Buffering settings, the same short buffer as VP8 streams keep latency low
+  int bufsize = 10;
+  codec_context_->rc_buffer_size = bufsize;
+  codec_context_->rc_initial_buffer_occupancy = bufsize;
+  codec_context_->rc_buffer_aggressivity = 0.5;
+  codec_context_->frame_skip_threshold = 10;
+}
+
+Vp9StreamerType::Vp9StreamerType(boost::shared_ptr<ImageTopicHub> topic_hub, int encoder_threads) :
+    LibavStreamerType(topic_hub, "webm", "libvpx-vp9", "video/webm", encoder_threads)
+{
+}
+
+boost::shared_ptr<LibavStreamer> Vp9StreamerType::create_libav_streamer(const async_web_server_cpp::HttpRequest& request,
+                                                                       async_web_server_cpp::HttpConnectionPtr connection,
+                                                                       ros::NodeHandle& nh)
+{
+  return boost::shared_ptr<LibavStreamer>(new Vp9Streamer(request, connection, nh, topic_hub_));
+}
+
+}
@@ -9,6 +9,9 @@
 #include "web_video_server/ros_compressed_streamer.h"
 #include "web_video_server/jpeg_streamers.h"
 #include "web_video_server/vp8_streamer.h"
+#include "web_video_server/vp9_streamer.h"
+#include "web_video_server/h264_streamer.h"
+#include "web_video_server/raw_streamer.h"
 #include "async_web_server_cpp/http_reply.hpp"
 
 namespace web_video_server
@@ -51,9 +54,32 @@ WebVideoServer::WebVideoServer(ros::NodeHandle &nh, ros::NodeHandle &private_nh)
 
   private_nh.param("ros_threads", ros_threads_, 2);
 
-  stream_types_["mjpeg"] = boost::shared_ptr<ImageStreamerType>(new MjpegStreamerType());
-  stream_types_["ros_compressed"] = boost::shared_ptr<ImageStreamerType>(new RosCompressedStreamerType());
-  stream_types_["vp8"] = boost::shared_ptr<ImageStreamerType>(new Vp8StreamerType());
+  // Images are converted and encoded on worker threads, ros_threads only receive them. Libav encoders can run up to
+  // encoder_threads more besides the workers calling them, each of those parks a worker while the stream lasts.
+  int cores = std::max((int)boost::thread::hardware_concurrency(), 1);
+  int worker_threads;
+  private_nh.param("worker_threads", worker_threads, cores);
+  int encoder_threads;
+  private_nh.param("encoder_threads", encoder_threads, std::max(worker_threads - 1, 0));
+  topic_hub_.reset(new ImageTopicHub(nh_, boost::shared_ptr<EncoderPool>(new EncoderPool(worker_threads))));
+  jpeg_encode_cache_.reset(new JpegEncodeCache(JpegEncoder::create(private_nh)));
+
+  stream_types_["mjpeg"] = boost::shared_ptr<ImageStreamerType>(new MjpegStreamerType(topic_hub_, jpeg_encode_cache_));
+  stream_types_["ros_compressed"] = boost::shared_ptr<ImageStreamerType>(
+      new RosCompressedStreamerType(topic_hub_, jpeg_encode_cache_));
+  stream_types_["vp8"] = boost::shared_ptr<ImageStreamerType>(new Vp8StreamerType(topic_hub_, encoder_threads));
+  stream_types_["vp9"] = boost::shared_ptr<ImageStreamerType>(new Vp9StreamerType(topic_hub_, encoder_threads));
+  stream_types_["h264"] = boost::shared_ptr<ImageStreamerType>(new H264StreamerType(topic_hub_, encoder_threads));
+  stream_types_["raw"] = boost::shared_ptr<ImageStreamerType>(new RawStreamerType(topic_hub_));
+
+  // Streams are unlimited unless the request or this parameter says otherwise
+  double max_fps;
+  private_nh.param("max_fps", max_fps, 0.0);
+  for (std::map<std::string, boost::shared_ptr<ImageStreamerType> >::iterator itr = stream_types_.begin();
+      itr != stream_types_.end(); ++itr)
+  {
+    itr->second->setDefaultMaxFps(max_fps);
+  }
 
   handler_group_.addHandlerForPath("/", boost::bind(&WebVideoServer::handle_list_streams, this, _1, _2, _3, _4));
   handler_group_.addHandlerForPath("/stream", boost::bind(&WebVideoServer::handle_stream, this, _1, _2, _3, _4));
@@ -97,6 +123,7 @@ void WebVideoServer::cleanup_inactive_streams()
     }
     image_subscribers_.erase(new_end, image_subscribers_.end());
   }
+  topic_hub_->cleanup();
 }
 
 bool WebVideoServer::handle_stream(const async_web_server_cpp::HttpRequest &request,
@@ -104,6 +131,16 @@ bool WebVideoServer::handle_stream(const async_web_server_cpp::HttpRequest &requ
                                    const char* end)
 {
   std::string type = request.get_query_param_value_or_default("type", "mjpeg");
+  if (type == "mjpeg" && can_pass_through_compressed(request))
+  {
+    // The camera already publishes the JPEGs we would encode, send those instead
+    if (__verbose)
+    {
+      ROS_INFO_STREAM("Passing through compressed images for mjpeg stream of "
+                      << request.get_query_param_value_or_default("topic", ""));
+    }
+    type = "ros_compressed";
+  }
   if (stream_types_.find(type) != stream_types_.end())
   {
     boost::shared_ptr<ImageStreamer> streamer = stream_types_[type]->create_streamer(request, connection, nh_);
@@ -119,11 +156,45 @@ bool WebVideoServer::handle_stream(const async_web_server_cpp::HttpRequest &requ
   return true;
 }
 
+bool WebVideoServer::can_pass_through_compressed(const async_web_server_cpp::HttpRequest &request)
+{
+  static const char* overrides[] = {"width", "height", "invert", "quality", "bitrate"};
+  for (size_t i = 0; i < sizeof(overrides) / sizeof(overrides[0]); ++i)
+  {
+    if (request.has_query_param(overrides[i]))
+      return false;
+  }
+  std::string default_transport = request.get_query_param_value_or_default("default_transport", "raw");
+  if (default_transport != "raw" && default_transport != "compressed")
+    return false;
+
+  std::string topic = request.get_query_param_value_or_default("topic", "");
+  if (topic.empty())
+    return false;
+  std::string compressed_topic = nh_.resolveName(topic) + "/compressed";
+
+  // compressed_image_transport publishes JPEG unless configured otherwise
+  std::string format;
+  nh_.param<std::string>(compressed_topic + "/format", format, "jpeg");
+  if (format != "jpeg")
+    return false;
+
+  std::string compressed_image_message_type = ros::message_traits::datatype<sensor_msgs::CompressedImage>();
+  ros::master::V_TopicInfo topics;
+  ros::master::getTopics(topics);
+  for (ros::master::V_TopicInfo::iterator it = topics.begin(); it != topics.end(); ++it)
+  {
+    if (it->name == compressed_topic && it->datatype == compressed_image_message_type)
+      return true;
+  }
+  return false;
+}
+
 bool WebVideoServer::handle_snapshot(const async_web_server_cpp::HttpRequest &request,
                                      async_web_server_cpp::HttpConnectionPtr connection, const char* begin,
                                      const char* end)
 {
-  boost::shared_ptr<ImageStreamer> streamer(new JpegSnapshotStreamer(request, connection, nh_));
+  boost::shared_ptr<ImageStreamer> streamer(new JpegSnapshotStreamer(request, connection, nh_, topic_hub_, jpeg_encode_cache_));
   streamer->start();
 
   boost::mutex::scoped_lock lock(subscriber_mutex_);